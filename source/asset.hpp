@@ -0,0 +1,238 @@
+#pragma once
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "util.hpp"
+
+#define ASSET_CHECK_INTERVAL 2000 // 定时检查webroot中文件是否被修改的间隔(ms)
+#define ASSET_GZIP_MIN_SIZE 256   // 小于该大小的文件不值得压缩
+
+typedef enum
+{
+    RANGE_NONE,         // 没有Range头部或者不支持的格式(如多段)，返回完整内容
+    RANGE_OK,           // 合法的单段范围，返回206
+    RANGE_UNSATISFIABLE // 范围超出文件大小，返回416
+} RangeResult_t;
+
+// 缓存中的一个静态资源：文件内容、预先压缩好的gzip版本以及响应需要的头部
+// 内容都读入堆内存：websocketpp的响应正文本身就是std::string，映射文件也要整体拷贝一次；
+// 而且部署时原地改写或截断文件，访问映射会触发SIGBUS
+struct Asset
+{
+    const char *data() const { return body.data(); }
+    size_t length() const { return body.size(); }
+
+    std::string body;                // 文件的原始内容
+    std::string gzip_body;           // gzip压缩后的内容，为空表示没有压缩版本
+    std::string content_type;        // Content-Type
+    std::string etag;                // ETag，由文件大小和修改时间生成
+    std::string last_modified;       // Last-Modified，HTTP日期格式
+    time_t mtime;                    // 加载时文件的修改时间，用于检测文件变化
+    off_t size;                      // 加载时文件的大小
+};
+
+using asset_ptr = std::shared_ptr<const Asset>;
+
+/**
+ * 静态资源缓存：启动时把webroot下的文件全部加载到内存，请求路径上只查内存不访问文件系统
+ * 文件的变化由定时调用refresh()检测：修改时间或大小变了就重新加载，新增的文件加入，删除的文件移除
+ */
+class AssetCache
+{
+public:
+    AssetCache(const std::string &root) : _root(root) {}
+    // 加载webroot下的所有文件
+    void load()
+    {
+        refresh();
+        INF_LOG("静态资源缓存加载完毕，共 %lu 个文件", (unsigned long)_assets.size());
+    }
+    // 通过uri路径(如/login.html)获取缓存的资源，没有找到返回空指针
+    asset_ptr get(const std::string &path)
+    {
+        std::lock_guard<std::mutex> lck(_mutex);
+        auto it = _assets.find(path);
+        if (it == _assets.end())
+        {
+            return asset_ptr();
+        }
+        return it->second;
+    }
+    // 扫描webroot，重新加载发生变化的文件
+    void refresh()
+    {
+        std::vector<std::pair<std::string, struct stat>> files;
+        scan("", files);
+
+        std::unordered_map<std::string, asset_ptr> fresh;
+        for (auto &f : files)
+        {
+            asset_ptr old = get(f.first);
+            if (old.get() != nullptr && old->mtime == f.second.st_mtime && old->size == f.second.st_size)
+            {
+                fresh.insert(std::make_pair(f.first, old)); // 文件没有变化，沿用原来的缓存
+                continue;
+            }
+            asset_ptr ap = build(f.first, f.second);
+            if (ap.get() == nullptr)
+                continue;
+            if (old.get() != nullptr)
+                DBG_LOG("静态资源 %s 发生变化，重新加载", f.first.c_str());
+            fresh.insert(std::make_pair(f.first, ap));
+        }
+        std::lock_guard<std::mutex> lck(_mutex);
+        _assets.swap(fresh);
+    }
+    // 解析 Range: bytes=start-end / bytes=start- / bytes=-suffix，得到闭区间[start, end]
+    static RangeResult_t parse_range(const std::string &range, size_t total, size_t &start, size_t &end)
+    {
+        const std::string prefix = "bytes=";
+        if (range.compare(0, prefix.size(), prefix) != 0 || range.find(',') != std::string::npos)
+            return RANGE_NONE;
+        std::string spec = range.substr(prefix.size());
+        size_t dash = spec.find('-');
+        if (dash == std::string::npos)
+            return RANGE_NONE;
+        std::string first = spec.substr(0, dash), last = spec.substr(dash + 1);
+        if (first.find_first_not_of("0123456789") != std::string::npos ||
+            last.find_first_not_of("0123456789") != std::string::npos || (first.empty() && last.empty()))
+            return RANGE_NONE;
+        if (first.empty())
+        {
+            // 后缀范围：最后N个字节
+            size_t suffix = strtoull(last.c_str(), nullptr, 10);
+            if (suffix == 0 || total == 0)
+                return RANGE_UNSATISFIABLE;
+            start = suffix >= total ? 0 : total - suffix;
+            end = total - 1;
+            return RANGE_OK;
+        }
+        start = strtoull(first.c_str(), nullptr, 10);
+        end = last.empty() ? total - 1 : strtoull(last.c_str(), nullptr, 10);
+        if (start >= total || end < start)
+            return RANGE_UNSATISFIABLE;
+        if (end >= total)
+            end = total - 1;
+        return RANGE_OK;
+    }
+
+private:
+    // 递归扫描目录，收集所有普通文件的uri路径和stat信息
+    void scan(const std::string &dir, std::vector<std::pair<std::string, struct stat>> &files)
+    {
+        std::string real_dir = _root + dir;
+        DIR *dp = opendir(real_dir.c_str());
+        if (dp == nullptr)
+        {
+            ERR_LOG("open dir fail:%s", real_dir.c_str());
+            return;
+        }
+        struct dirent *ent;
+        while ((ent = readdir(dp)) != nullptr)
+        {
+            if (ent->d_name[0] == '.')
+                continue; // 跳过 . .. 以及隐藏文件
+            std::string path = dir + "/" + ent->d_name;
+            struct stat st;
+            if (stat((_root + path).c_str(), &st) != 0)
+                continue;
+            if (S_ISDIR(st.st_mode))
+                scan(path, files);
+            else if (S_ISREG(st.st_mode))
+                files.push_back(std::make_pair(path, st));
+        }
+        closedir(dp);
+    }
+    asset_ptr build(const std::string &path, const struct stat &st)
+    {
+        std::shared_ptr<Asset> ap(new Asset());
+        if (FilereadUtil::read(_root + path, ap->body) == false)
+        {
+            return asset_ptr();
+        }
+        ap->mtime = st.st_mtime;
+        ap->size = st.st_size;
+        ap->content_type = content_type(path);
+        char buf[64] = {0};
+        snprintf(buf, sizeof(buf), "\"%lx-%lx\"", (unsigned long)st.st_size, (unsigned long)st.st_mtime);
+        ap->etag = buf;
+        struct tm gmt;
+        gmtime_r(&st.st_mtime, &gmt);
+        strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+        ap->last_modified = buf;
+        if (compressible(ap->content_type) && ap->body.size() >= ASSET_GZIP_MIN_SIZE)
+        {
+            std::string gz;
+            // 压缩后没有变小就不保留压缩版本
+            if (gzip(ap->body, gz) && gz.size() < ap->body.size())
+                ap->gzip_body.swap(gz);
+        }
+        return ap;
+    }
+    static std::string content_type(const std::string &path)
+    {
+        static const std::unordered_map<std::string, std::string> types = {
+            {"html", "text/html; charset=utf-8"},
+            {"css", "text/css; charset=utf-8"},
+            {"js", "application/javascript; charset=utf-8"},
+            {"json", "application/json"},
+            {"txt", "text/plain; charset=utf-8"},
+            {"svg", "image/svg+xml"},
+            {"jpg", "image/jpeg"},
+            {"jpeg", "image/jpeg"},
+            {"png", "image/png"},
+            {"gif", "image/gif"},
+            {"ico", "image/x-icon"},
+        };
+        size_t pos = path.rfind('.');
+        if (pos != std::string::npos)
+        {
+            auto it = types.find(path.substr(pos + 1));
+            if (it != types.end())
+                return it->second;
+        }
+        return "application/octet-stream";
+    }
+    static bool compressible(const std::string &type)
+    {
+        return type.compare(0, 5, "text/") == 0 || type.find("javascript") != std::string::npos ||
+               type.find("json") != std::string::npos || type.find("svg") != std::string::npos;
+    }
+    static bool gzip(const std::string &src, std::string &dst)
+    {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        // windowBits 15+16 表示输出gzip格式而不是zlib格式
+        if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            ERR_LOG("gzip init fail");
+            return false;
+        }
+        dst.resize(deflateBound(&zs, src.size()));
+        zs.next_in = (Bytef *)src.data();
+        zs.avail_in = src.size();
+        zs.next_out = (Bytef *)&dst[0];
+        zs.avail_out = dst.size();
+        int ret = deflate(&zs, Z_FINISH);
+        deflateEnd(&zs);
+        if (ret != Z_STREAM_END)
+        {
+            ERR_LOG("gzip compress fail");
+            return false;
+        }
+        dst.resize(zs.total_out);
+        return true;
+    }
+
+private:
+    std::string _root;                                  // webroot根目录
+    std::mutex _mutex;                                  // 保护_assets，多个事件循环线程会同时查找
+    std::unordered_map<std::string, asset_ptr> _assets; // uri路径和缓存资源的映射
+};
@@ -0,0 +1,107 @@
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+
+#include "util.hpp"
+#include "message.hpp"
+
+// 独立的benchmark程序：替换全局的operator new来统计分配次数，不能链接进服务器
+/*************************统计内存分配次数，用于benchmark*****************************/
+static std::atomic<uint64_t> g_alloc_count(0);
+void *operator new(std::size_t size)
+{
+    ++g_alloc_count;
+    void *p = malloc(size);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+
+// 改造之前的JsonUtil实现：每次调用都构建builder、分配writer/reader和stringstream
+static bool legacy_serialize(const Json::Value &root, std::string *str)
+{
+    std::stringstream ss;
+    std::unique_ptr<Json::StreamWriter> sw(Json::StreamWriterBuilder().newStreamWriter());
+    if (sw->write(root, &ss) != 0)
+        return false;
+    *str = ss.str();
+    return true;
+}
+static bool legacy_unserialize(const std::string &str, Json::Value &root)
+{
+    std::string err;
+    std::unique_ptr<Json::CharReader> cr(Json::CharReaderBuilder().newCharReader());
+    return cr->parse(str.c_str(), str.c_str() + str.size(), &root, &err);
+}
+// 一次put_chess往返中的json操作：解析请求，构建响应并序列化
+static void put_chess_resp(const Json::Value &req, Json::Value &resp)
+{
+    resp["optype"] = "put_chess";
+    resp["result"] = true;
+    resp["reason"] = "游戏继续";
+    resp["room_id"] = req["room_id"];
+    resp["uid"] = req["uid"];
+    resp["row"] = req["row"];
+    resp["col"] = req["col"];
+    resp["winner"] = 0;
+}
+void JsonUtil_bench()
+{
+    const std::string req_body = "{\"optype\":\"put_chess\",\"room_id\":222,\"uid\":1,\"row\":3,\"col\":2}";
+    const int N = 100000;
+    std::string body;
+    {
+        uint64_t allocs = g_alloc_count;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < N; ++i)
+        {
+            Json::Value req, resp;
+            legacy_unserialize(req_body, req);
+            put_chess_resp(req, resp);
+            legacy_serialize(resp, &body);
+        }
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "before: " << (double)(g_alloc_count - allocs) / N << " allocs/op, "
+                  << ns / N << " ns/op, " << body.size() << " bytes" << std::endl;
+    }
+    {
+        uint64_t allocs = g_alloc_count;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < N; ++i)
+        {
+            Json::Value req, resp;
+            JsonUtil::unserialize(req_body, req);
+            put_chess_resp(req, resp);
+            JsonUtil::serialize(resp, &body);
+        }
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "after:  " << (double)(g_alloc_count - allocs) / N << " allocs/op, "
+                  << ns / N << " ns/op, " << body.size() << " bytes" << std::endl;
+    }
+    {
+        uint64_t allocs = g_alloc_count;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < N; ++i)
+        {
+            Json::Value req;
+            JsonUtil::unserialize(req_body, req);
+            PutChessResp resp = {req["col"].asInt(), "游戏继续", req["room_id"].asUInt64(),
+                                 req["row"].asInt(), req["uid"].asUInt64(), 0};
+            json_encode(resp, body);
+        }
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "schema: " << (double)(g_alloc_count - allocs) / N << " allocs/op, "
+                  << ns / N << " ns/op, " << body.size() << " bytes" << std::endl;
+    }
+}
+
+int main()
+{
+    JsonUtil_bench();
+
+    return 0;
+}
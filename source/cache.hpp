@@ -0,0 +1,132 @@
+#pragma once
+
+#include <chrono>
+#include <cstring>
+#include <list>
+#include <unordered_map>
+
+#include "util.hpp"
+
+#define PROFILE_CACHE_SHARDS 16    // 分片数，减少多线程下的锁竞争
+#define PROFILE_CACHE_SIZE 65536   // 最多缓存的用户数，超过后淘汰最久未访问的
+#define PROFILE_CACHE_TTL 60000    // 缓存的有效期(ms)，绕过本服务直接修改数据库时最多这么久之后能看到
+
+// 缓存的用户信息（和select_by_id的结果一致，id就是缓存的key）
+struct UserProfile
+{
+    std::string username;
+    int socre;
+    int total_count;
+    int win_count;
+};
+
+/**
+ * 用户信息的进程内缓存：按uid分片，每个分片一把锁和一条LRU链表
+ * select_by_id先查缓存，没有命中再查数据库并放入缓存(read-through)；积分变化时删除对应的缓存项
+ * 查数据库期间缓存项可能刚好被删除，这时再放入的就是旧数据：
+ * 每个分片有一个删除计数，查询前记下，放入时计数已经变化就不放入
+ */
+class ProfileCache
+{
+public:
+    ProfileCache(size_t capacity = PROFILE_CACHE_SIZE, int ttl_ms = PROFILE_CACHE_TTL)
+        : _shard_cap(capacity / PROFILE_CACHE_SHARDS + 1), _ttl_ms(ttl_ms), _hits(0), _misses(0), _logged{0, 0} {}
+    // 查找uid的缓存，没有命中时通过gen返回分片当前的删除计数，放入时使用
+    bool get(uint64_t uid, UserProfile &profile, uint64_t &gen)
+    {
+        Shard &shard = _shards[uid % PROFILE_CACHE_SHARDS];
+        std::lock_guard<std::mutex> lck(shard.mutex);
+        auto it = shard.items.find(uid);
+        if (it == shard.items.end() || now_ms() > it->second.expire)
+        {
+            if (it != shard.items.end())
+                erase(shard, it);
+            gen = shard.gen;
+            ++_misses;
+            return false;
+        }
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru); // 移动到LRU链表头部
+        profile = it->second.profile;
+        ++_hits;
+        return true;
+    }
+    // 放入从数据库中查到的信息，gen是get没有命中时返回的删除计数
+    void put(uint64_t uid, const UserProfile &profile, uint64_t gen)
+    {
+        Shard &shard = _shards[uid % PROFILE_CACHE_SHARDS];
+        std::lock_guard<std::mutex> lck(shard.mutex);
+        if (gen != shard.gen)
+            return; // 查询期间有缓存项被删除，查到的可能是旧数据
+        auto it = shard.items.find(uid);
+        if (it != shard.items.end())
+            erase(shard, it);
+        if (shard.items.size() >= _shard_cap)
+            erase(shard, shard.items.find(shard.lru.back())); // 淘汰最久未访问的
+        shard.lru.push_front(uid);
+        Item item = {profile, now_ms() + _ttl_ms, shard.lru.begin()};
+        shard.items.insert(std::make_pair(uid, item));
+    }
+    // 用户信息发生变化时删除缓存
+    void invalidate(uint64_t uid)
+    {
+        Shard &shard = _shards[uid % PROFILE_CACHE_SHARDS];
+        std::lock_guard<std::mutex> lck(shard.mutex);
+        ++shard.gen;
+        auto it = shard.items.find(uid);
+        if (it != shard.items.end())
+            erase(shard, it);
+    }
+    uint64_t hits() { return _hits; }
+    uint64_t misses() { return _misses; }
+    double hit_rate()
+    {
+        uint64_t hits = _hits, total = hits + _misses;
+        return total == 0 ? 0 : (double)hits / total;
+    }
+    // 和上一次相比有变化时输出命中率（由服务器的统计定时任务调用）
+    void log_stats()
+    {
+        uint64_t now[2] = {_hits, _misses};
+        if (memcmp(now, _logged, sizeof(now)) == 0)
+            return;
+        memcpy(_logged, now, sizeof(now));
+        uint64_t total = now[0] + now[1];
+        INF_LOG("用户信息缓存: 命中 %lu 次, 未命中 %lu 次, 命中率 %.1f%%", (unsigned long)now[0], (unsigned long)now[1],
+                total == 0 ? 0 : 100.0 * now[0] / total);
+    }
+
+private:
+    struct Item
+    {
+        UserProfile profile;
+        int64_t expire;                     // 过期时间(ms)
+        std::list<uint64_t>::iterator lru;  // 在LRU链表中的位置
+    };
+    struct Shard
+    {
+        Shard() : gen(0) {}
+        std::mutex mutex;
+        std::unordered_map<uint64_t, Item> items;
+        std::list<uint64_t> lru; // 头部是最近访问的uid
+        uint64_t gen;            // 删除计数
+    };
+    static void erase(Shard &shard, std::unordered_map<uint64_t, Item>::iterator it)
+    {
+        shard.lru.erase(it->second.lru);
+        shard.items.erase(it);
+    }
+    static int64_t now_ms()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+private:
+    size_t _shard_cap;
+    int _ttl_ms;
+    std::atomic<uint64_t> _hits;
+    std::atomic<uint64_t> _misses;
+    uint64_t _logged[2]; // 上一次输出的统计，只在统计定时任务中访问
+    Shard _shards[PROFILE_CACHE_SHARDS];
+};
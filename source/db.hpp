@@ -1,75 +1,89 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
-#include <mutex>
+#include <map>
+#include <vector>
 
+#include "cache.hpp"
+#include "pool.hpp"
+#include "store.hpp"
 #include "util.hpp"
 
-class UserTable
+// UserStore的mysql实现
+class UserTable : public UserStore
 {
 public:
     UserTable(const std::string &host, const std::string &user,
-               const std::string &password, const std::string &db, uint16_t port = 3306)
+               const std::string &password, const std::string &db, uint16_t port = 3306,
+               size_t pool_size = MYSQL_POOL_SIZE)
+        : _pool(host, user, password, db, port, pool_size)
     {
-        _mysql = MysqlUtil::mysql_create(host, user, password, db, port);
-        assert(_mysql != nullptr);
+        assert(_pool.ready());
+        load_leaderboard();
     }
-    ~UserTable()
+    // 连接池的统计信息
+    MysqlPoolStats pool_stats() { return _pool.stats(); }
+    void log_stats() override
     {
-        MysqlUtil::mysql_destory(_mysql);
-        _mysql = nullptr;
+        _pool.log_stats();
+        _cache.log_stats();
     }
     // 注意，这里的函数没有控制输入的参数一定是username和password，在前端要实现数据校验！！！！
+    // 所有语句都是预处理语句：在每个连接上只预处理一次，参数单独发送（不会被拼接进sql），结果直接以二进制绑定到整数
 
     // 注册时新增用户
-    bool insert(Json::Value &user)
+    bool insert(Json::Value &user) override
     {
-#define DEFAULT_SOCRE 1000 // 默认的天梯分数值
-#define ADD_SOCRE 30       // 每次胜利增加的天梯分数值
-#define INSERT_USER "insert user values(null, '%s', password('%s'), %d, 0, 0);"
+#define INSERT_USER "insert user values(null, ?, password(?), ?, 0, 0);"
 
         Json::Value val;
-        bool ret = select_by_name(user["username"].asCString(), val);
+        bool ret = select_by_name(user["username"].asString(), val);
         if (ret == true)
         {
             DBG_LOG("user:%s is already exists", user["username"].asCString());
             return false;
         }
-        char sql[4096] = {0};
-        snprintf(sql, sizeof(sql) - 1, INSERT_USER, user["username"].asCString(), user["password"].asCString(), DEFAULT_SOCRE);
-        ret = MysqlUtil::mysql_exec(_mysql, sql);
-        if (ret == false)
+        std::string username = user["username"].asString();
+        std::string password = user["password"].asString();
+        int socre = DEFAULT_SOCRE;
+        MysqlBinds params;
+        params.add(username).add(password).add(&socre);
+        MysqlPool::Guard conn = _pool.acquire();
+        MYSQL_STMT *stmt = conn ? conn.execute(INSERT_USER, params.get()) : nullptr;
+        if (stmt == nullptr)
         {
             ERR_LOG("insert user info fail");
             return false;
         }
+        _rank.set(mysql_stmt_insert_id(stmt), username, socre);
         return true;
     }
 
     // 登录时验证用户并把其他信息放进user中
-    bool login(Json::Value &user)
+    bool login(Json::Value &user) override
     {
-#define LOGIN_USER "select id,socre, total_count, win_count from user where username='%s' and password=password('%s');"
-        char sql[4096] = {0};
-        snprintf(sql, sizeof(sql) - 1, LOGIN_USER, user["username"].asCString(), user["password"].asCString());
-        MYSQL_RES *res = NULL;
+#define LOGIN_USER "select id, socre, total_count, win_count from user where username=? and password=password(?);"
+        std::string username = user["username"].asString();
+        std::string password = user["password"].asString();
+        MysqlBinds params;
+        params.add(username).add(password);
+        uint64_t id = 0;
+        int socre = 0, total_count = 0, win_count = 0;
+        MysqlBinds result;
+        result.add(&id).add(&socre).add(&total_count).add(&win_count);
+        int row_num = -1;
         {
-            std::lock_guard<std::mutex> lck(_mutex);
-            bool ret = MysqlUtil::mysql_exec(_mysql, sql);
-            if (ret == false) // 没有查询到指定信息
+            MysqlPool::Guard conn = _pool.acquire();
+            MYSQL_STMT *stmt = conn ? conn.execute(LOGIN_USER, params.get()) : nullptr;
+            if (stmt == nullptr) // 没有查询到指定信息
             {
                 DBG_LOG("user login fail");
                 return false;
             }
-            res = mysql_store_result(_mysql);
-            if (res == NULL)
-            {
-                DBG_LOG("have no login user info");
-                return false;
-            }
+            row_num = conn.fetch_one(stmt, result.get());
         }
-        int row_num = mysql_num_rows(res);
-        if (row_num == 0)
+        if (row_num <= 0)
         {
             DBG_LOG("have no login user info");
             return false;
@@ -79,125 +93,326 @@ public:
             DBG_LOG("The queried user information is not unique");
             return false;
         }
-        MYSQL_ROW row = mysql_fetch_row(res);
-        user["id"] = std::stoi(row[0]);
-        user["socre"] = std::stoi(row[1]);
-        user["total_count"] = std::stoi(row[2]);
-        user["win_count"] = std::stoi(row[3]);
-        mysql_free_result(res);
+        user["id"] = Json::Value::UInt64(id);
+        user["socre"] = socre;
+        user["total_count"] = total_count;
+        user["win_count"] = win_count;
         return true;
     }
 
     // 使用username查询，如果查到将结果放进user中
-    bool select_by_name(const std::string &username, Json::Value &user)
+    bool select_by_name(const std::string &username, Json::Value &user) override
     {
-#define SELECT_BY_NAME "select id,socre, total_count, win_count from user where username='%s';"
-        char sql[4096] = {0};
-        snprintf(sql, sizeof(sql) - 1, SELECT_BY_NAME, username.c_str());
-        MYSQL_RES *res = NULL;
+#define SELECT_BY_NAME "select id, socre, total_count, win_count from user where username=?;"
+        MysqlBinds params;
+        params.add(username);
+        uint64_t id = 0;
+        int socre = 0, total_count = 0, win_count = 0;
+        MysqlBinds result;
+        result.add(&id).add(&socre).add(&total_count).add(&win_count);
+        int row_num = -1;
         {
-            std::lock_guard<std::mutex> lck(_mutex);
-            bool ret = MysqlUtil::mysql_exec(_mysql, sql);
-            if (ret == false)
-            {
-                DBG_LOG("get user by name fail: %s", mysql_error(_mysql));
-                return false;
-            }
-            res = mysql_store_result(_mysql);
-            if (res == NULL)
+            MysqlPool::Guard conn = _pool.acquire();
+            MYSQL_STMT *stmt = conn ? conn.execute(SELECT_BY_NAME, params.get()) : nullptr;
+            if (stmt == nullptr)
             {
-                DBG_LOG("The user:%s does not exist", username);
+                DBG_LOG("get user by name fail");
                 return false;
             }
+            row_num = conn.fetch_one(stmt, result.get());
         }
-        MYSQL_ROW row = mysql_fetch_row(res);
-        if (row == NULL)
+        if (row_num <= 0)
         {
-            // DBG_LOG("The user:%s does not exist(res中没有内容，导致row为NULL)", username);
+            // DBG_LOG("The user:%s does not exist", username.c_str());
             return false;
         }
-        user["id"] = Json::Value::UInt64(std::stoull(row[0]));
+        user["id"] = Json::Value::UInt64(id);
         user["username"] = username;
-        user["socre"] = std::stoi(row[1]);
-        user["total_count"] = std::stoi(row[2]);
-        user["win_count"] = std::stoi(row[3]);
+        user["socre"] = socre;
+        user["total_count"] = total_count;
+        user["win_count"] = win_count;
+        return true;
+    }
 
-        mysql_free_result(res);
+    // 使用id查询，如果查到将结果放进user中（先查缓存，没有命中再查数据库）
+    bool select_by_id(uint64_t id, Json::Value &user) override
+    {
+#define SELECT_BY_ID "select username, socre, total_count, win_count from user where id=?;"
+#define USERNAME_MAX 128 // username是varchar(32)，utf8下最多96个字节
+        UserProfile profile;
+        uint64_t gen = 0;
+        if (_cache.get(id, profile, gen) == false)
+        {
+            if (load_profile(id, profile) == false)
+                return false;
+            _cache.put(id, profile, gen);
+        }
+        user["id"] = Json::Value::UInt64(id); // 这里要使用UInt64转换为json的类型，否则会出现构造函数调用不明确
+        user["username"] = profile.username;
+        user["socre"] = profile.socre;
+        user["total_count"] = profile.total_count;
+        user["win_count"] = profile.win_count;
+        return true;
+    }
+    // 用户信息缓存的命中率等统计
+    ProfileCache &profile_cache() { return _cache; }
 
+    // 给赢得人设置相关信息（天梯分数增加，总场数和胜场数增加）
+    bool win(uint64_t id) override
+    {
+#define ALTER_WIN "update user set socre=socre+?,total_count=total_count+1,win_count=win_count+1 where id=?;"
+        int add = ADD_SOCRE;
+        MysqlBinds params;
+        params.add(&add).add(&id);
+        MysqlPool::Guard conn = _pool.acquire();
+        bool ret = conn && conn.execute(ALTER_WIN, params.get()) != nullptr;
+        _cache.invalidate(id); // 执行失败时也可能已经修改
+        if (ret == false)
+        {
+            DBG_LOG("update win info fail");
+            return false;
+        }
+        _rank.add(id, ADD_SOCRE);
         return true;
     }
 
-    // 使用id查询，如果查到将结果放进user中
-    bool select_by_id(uint64_t id, Json::Value &user)
+    // 给输的人设置相关信息（胜场数增加）
+    bool lose(uint64_t id) override
     {
-#define SELECT_BY_ID "select username,socre, total_count, win_count from user where id=%d;"
-        char sql[4096] = {0};
+#define ALTER_LOSE "update user set total_count=total_count+1 where id=?;"
+        MysqlBinds params;
+        params.add(&id);
+        MysqlPool::Guard conn = _pool.acquire();
+        bool ret = conn && conn.execute(ALTER_LOSE, params.get()) != nullptr;
+        _cache.invalidate(id); // 执行失败时也可能已经修改
+        if (ret == false)
+        {
+            DBG_LOG("update lose info fail");
+            return false;
+        }
+        return true;
+    }
 
-        snprintf(sql, sizeof(sql) - 1, SELECT_BY_ID, id);
-        MYSQL_RES *res = NULL;
+    // 在一个事务中写入一批对战结果：同一个玩家的多局结果合并成一条update，对战记录用多行insert写入，最后把检查点更新为这批结果的最大序号
+    // 检查点、积分和对战记录在同一个事务中提交，重放日志时序号不大于检查点的结果已经写入过，不会重复计算
+    bool apply_results(const std::vector<GameResult> &results) override
+    {
+#define APPLY_RESULT "update user set socre=socre+?,total_count=total_count+?,win_count=win_count+? where id=?;"
+#define SAVE_CHECKPOINT "replace into result_checkpoint values(1, ?);"
+        struct Delta
         {
-            std::lock_guard<std::mutex> lck(_mutex);
-            bool ret = MysqlUtil::mysql_exec(_mysql, sql);
-            if (ret == false)
+            int socre;
+            int total_count;
+            int win_count;
+        };
+        std::map<uint64_t, Delta> deltas; // 按uid排序，多个事务并发时加锁顺序一致
+        uint64_t last_seq = 0;
+        for (auto &r : results)
+        {
+            Delta &w = deltas[r.winner];
+            w.socre += ADD_SOCRE;
+            w.total_count += 1;
+            w.win_count += 1;
+            deltas[r.loser].total_count += 1;
+            last_seq = std::max(last_seq, r.seq);
+        }
+        MysqlPool::Guard conn = _pool.acquire();
+        if (!conn || conn.begin() == false)
+            return false;
+        for (auto &it : deltas)
+        {
+            uint64_t id = it.first;
+            MysqlBinds params;
+            params.add(&it.second.socre).add(&it.second.total_count).add(&it.second.win_count).add(&id);
+            if (conn.execute(APPLY_RESULT, params.get()) == nullptr)
             {
-                DBG_LOG("get user by id fail %s", mysql_error(_mysql));
+                conn.rollback();
                 return false;
             }
-            res = mysql_store_result(_mysql);
-            if (res == NULL)
+        }
+        if (insert_games(conn, results) == false)
+        {
+            conn.rollback();
+            return false;
+        }
+        MysqlBinds params;
+        params.add(&last_seq);
+        if (conn.execute(SAVE_CHECKPOINT, params.get()) == nullptr)
+        {
+            conn.rollback();
+            return false;
+        }
+        bool ret = conn.commit();
+        for (auto &it : deltas)
+        {
+            _cache.invalidate(it.first); // 提交失败时也可能已经提交成功
+            if (ret && it.second.socre != 0)
+                _rank.add(it.first, it.second.socre);
+        }
+        return ret;
+    }
+    // 已经写入数据库的最大结果序号，查询失败返回false
+    bool result_checkpoint(uint64_t &seq) override
+    {
+#define SELECT_CHECKPOINT "select seq from result_checkpoint where id=1;"
+        seq = 0;
+        MysqlBinds result;
+        result.add(&seq);
+        MysqlPool::Guard conn = _pool.acquire();
+        MYSQL_STMT *stmt = conn ? conn.execute(SELECT_CHECKPOINT, nullptr) : nullptr;
+        if (stmt == nullptr)
+            return false;
+        return conn.fetch_one(stmt, result.get()) >= 0;
+    }
+    // 查询uid参与的对战记录，按id从新到旧，只返回id小于before的(keyset分页，翻到多深都只扫描limit行)
+    bool history(uint64_t uid, uint64_t before, int limit, std::vector<GameSummary> &list) override
+    {
+        // 白方和黑方各走自己的索引(white_id, id)/(black_id, id)，再合并取前limit个
+#define SELECT_HISTORY "(select id, white_id, black_id, winner, start_time, end_time, move_count from game " \
+                       "where white_id=? and id<? order by id desc limit ?) union all "                    \
+                       "(select id, white_id, black_id, winner, start_time, end_time, move_count from game " \
+                       "where black_id=? and id<? order by id desc limit ?) order by id desc limit ?;"
+        MysqlBinds params;
+        params.add(&uid).add(&before).add(&limit).add(&uid).add(&before).add(&limit).add(&limit);
+        GameSummary g = {};
+        MysqlBinds result;
+        result.add(&g.id).add(&g.white_id).add(&g.black_id).add(&g.winner);
+        result.add(&g.start_time).add(&g.end_time).add(&g.move_count);
+        list.clear();
+        MysqlPool::Guard conn = _pool.acquire();
+        MYSQL_STMT *stmt = conn ? conn.execute(SELECT_HISTORY, params.get()) : nullptr;
+        if (stmt == nullptr || conn.fetch_each(stmt, result.get(), [&]() { list.push_back(g); }) < 0)
+        {
+            DBG_LOG("get game history fail");
+            return false;
+        }
+        return true;
+    }
+    // 查询一局对战的完整记录，没有这局返回false
+    bool replay(uint64_t id, GameRecord &game) override
+    {
+#define SELECT_GAME "select white_id, black_id, winner, start_time, end_time, move_count, moves from game where id=?;"
+        MysqlBinds params;
+        params.add(&id);
+        char moves[GAME_MOVES_MAX];
+        unsigned long moves_len = 0;
+        MysqlBinds result;
+        result.add(&game.white_id).add(&game.black_id).add(&game.winner);
+        result.add(&game.start_time).add(&game.end_time).add(&game.move_count).add(moves, sizeof(moves), &moves_len);
+        int row_num = -1;
+        {
+            MysqlPool::Guard conn = _pool.acquire();
+            MYSQL_STMT *stmt = conn ? conn.execute(SELECT_GAME, params.get()) : nullptr;
+            if (stmt == nullptr)
             {
-                DBG_LOG("The id:%d does not exist", id);
+                DBG_LOG("get game by id fail");
                 return false;
             }
+            row_num = conn.fetch_one(stmt, result.get());
         }
-        int row_num = mysql_num_rows(res);
-
-        MYSQL_ROW row = mysql_fetch_row(res);
-        if (row == NULL)
-        {
-            // DBG_LOG("The user:%s does not exist(res中没有内容，导致row为NULL)", username);
+        if (row_num <= 0)
             return false;
-        }
-        user["id"] = Json::Value::UInt64(id); // 这里要使用UInt64转换为json的类型，否则会出现构造函数调用不明确
-        user["username"] = row[0];
-        user["socre"] = std::stoi(row[1]);
-        user["total_count"] = std::stoi(row[2]);
-        user["win_count"] = std::stoi(row[3]);
-        mysql_free_result(res);
+        game.moves.assign(moves, std::min<unsigned long>(moves_len, sizeof(moves)));
         return true;
     }
 
-    // 给赢得人设置相关信息（天梯分数增加，总场数和胜场数增加）
-    bool win(uint64_t id)
+private:
+    // 在conn的事务中写入一批结果的对战记录：每GAME_INSERT_BATCH局一条多行insert，剩下的不足GAME_INSERT_BATCH局也是一条多行insert
+    bool insert_games(MysqlPool::Guard &conn, const std::vector<GameResult> &results)
     {
-#define ALTER_WIN "update user set socre=socre+%d,total_count=total_count+1,win_count=win_count+1 where id=%d;"
-        char sql[4096] = {0};
-        snprintf(sql, sizeof(sql) - 1, ALTER_WIN, ADD_SOCRE, id);
-        bool ret = MysqlUtil::mysql_exec(_mysql, sql);
-        if (ret == false)
+#define GAME_INSERT_BATCH 16 // 一条insert语句最多写入的对战记录数
+#define GAME_INSERT_FIELDS 7 // 每条对战记录的字段数
+        // 1~GAME_INSERT_BATCH行的insert语句，预处理语句按sql的地址缓存在连接上，所以要一直有效
+        static const std::vector<std::string> insert_sqls = []() {
+            std::vector<std::string> sqls;
+            for (int rows = 1; rows <= GAME_INSERT_BATCH; ++rows)
+                sqls.push_back(insert_game_sql(rows));
+            return sqls;
+        }();
+        std::vector<GameRecord *> games;
+        for (auto &r : results)
         {
-            DBG_LOG("update win info fail: %s", mysql_error(_mysql));
-            return false;
+            if (r.game.winner != 0)
+                games.push_back(const_cast<GameRecord *>(&r.game)); // 只作为参数读取
+        }
+        size_t i = 0;
+        while (i < games.size())
+        {
+            size_t n = std::min<size_t>(games.size() - i, GAME_INSERT_BATCH);
+            MysqlBinds params(n * GAME_INSERT_FIELDS);
+            for (size_t j = i; j < i + n; ++j)
+            {
+                GameRecord *g = games[j];
+                params.add(&g->white_id).add(&g->black_id).add(&g->winner).add(&g->start_time).add(&g->end_time);
+                params.add(&g->move_count).add(g->moves, MYSQL_TYPE_BLOB);
+            }
+            if (conn.execute(insert_sqls[n - 1].c_str(), params.get()) == nullptr)
+                return false;
+            i += n;
         }
         return true;
     }
-
-    // 给输的人设置相关信息（胜场数增加）
-    bool lose(uint64_t id)
+    static std::string insert_game_sql(int rows)
     {
-#define ALTER_LOSE "update user set total_count=total_count+1 where id=%d;"
-        char sql[4096] = {0};
-        snprintf(sql, sizeof(sql) - 1, ALTER_LOSE, id);
-        bool ret = MysqlUtil::mysql_exec(_mysql, sql);
-        if (ret == false)
+        std::string sql = "insert into game(white_id, black_id, winner, start_time, end_time, move_count, moves) values";
+        for (int i = 0; i < rows; ++i)
+            sql += i == 0 ? "(?, ?, ?, ?, ?, ?, ?)" : ", (?, ?, ?, ?, ?, ?, ?)";
+        return sql + ";";
+    }
+    // 启动时把全部用户的积分加载到排行榜中
+    void load_leaderboard()
+    {
+#define SELECT_ALL_SOCRE "select id, username, socre from user;"
+        uint64_t id = 0;
+        char username[USERNAME_MAX];
+        unsigned long username_len = 0;
+        int socre = 0;
+        MysqlBinds result;
+        result.add(&id).add(username, sizeof(username), &username_len).add(&socre);
+        MysqlPool::Guard conn = _pool.acquire();
+        MYSQL_STMT *stmt = conn ? conn.execute(SELECT_ALL_SOCRE, nullptr) : nullptr;
+        int rows = stmt == nullptr ? -1 : conn.fetch_each(stmt, result.get(), [&]() {
+            _rank.set(id, std::string(username, std::min<unsigned long>(username_len, sizeof(username))), socre);
+        });
+        if (rows < 0)
+            ERR_LOG("加载排行榜失败，只包含之后注册的用户");
+        else
+            INF_LOG("排行榜加载了 %d 个用户", rows);
+    }
+    // 从数据库中读取用户信息
+    bool load_profile(uint64_t id, UserProfile &profile)
+    {
+        MysqlBinds params;
+        params.add(&id);
+        char username[USERNAME_MAX];
+        unsigned long username_len = 0;
+        int socre = 0, total_count = 0, win_count = 0;
+        MysqlBinds result;
+        result.add(username, sizeof(username), &username_len).add(&socre).add(&total_count).add(&win_count);
+        int row_num = -1;
+        {
+            MysqlPool::Guard conn = _pool.acquire();
+            MYSQL_STMT *stmt = conn ? conn.execute(SELECT_BY_ID, params.get()) : nullptr;
+            if (stmt == nullptr)
+            {
+                DBG_LOG("get user by id fail");
+                return false;
+            }
+            row_num = conn.fetch_one(stmt, result.get());
+        }
+        if (row_num <= 0)
         {
-            DBG_LOG("update lose info fail: %s", mysql_error(_mysql));
+            // DBG_LOG("The id:%lu does not exist", id);
             return false;
         }
+        profile.username.assign(username, std::min<unsigned long>(username_len, sizeof(username)));
+        profile.socre = socre;
+        profile.total_count = total_count;
+        profile.win_count = win_count;
         return true;
     }
 
 private:
-    MYSQL *_mysql;     // mysql的操作句柄
-    std::mutex _mutex; // 互斥锁保护访问数据库的操作
-};
\ No newline at end of file
+    MysqlPool _pool;     // mysql连接池，每次操作取出一个连接，用完归还
+    ProfileCache _cache; // select_by_id的用户信息缓存
+};
@@ -8,4 +8,20 @@ create table if not exists user(
     socre int,                          
     total_count int,                    
     win_count int                       
-);
\ No newline at end of file
+);
+create table if not exists result_checkpoint(
+    id int primary key,
+    seq bigint unsigned not null    -- 已经写入user表的最大对战结果序号
+);
+create table if not exists game(
+    id bigint unsigned primary key auto_increment,
+    white_id int not null,
+    black_id int not null,
+    winner int not null,
+    start_time bigint not null,        -- unix时间戳(秒)
+    end_time bigint not null,
+    move_count int not null,
+    moves varbinary(452) not null,     -- 每步10位的紧凑编码，下满19x19的棋盘是452字节
+    key white_game(white_id, id),      -- 按玩家做keyset分页
+    key black_game(black_id, id)
+);
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+
+#include "outbound.hpp"
+#include "util.hpp"
+
+#define HEARTBEAT_INTERVAL 15000 // 服务器发送ping的间隔(ms)
+#define HEARTBEAT_TIMEOUT 45000  // 超过该时间没有收到pong或任何消息，就认为连接已经失效(ms)
+
+/**
+ * 长连接心跳管理：半开的TCP连接不会触发close回调，它们会一直留在在线用户管理中，导致玩家被判定为重复登录、房间不销毁
+ * 这里由一个共享的定时任务周期性地遍历所有长连接，而不是给每个连接设置定时器：
+ *   - 最近活跃时间超过超时时间的连接调用close()，握手超时之后websocketpp会走正常的close回调完成清理
+ *   - 其他连接发送ping，收到pong或者任何消息时刷新最近活跃时间（只是一次原子写）
+ */
+class HeartbeatManager
+{
+public:
+    HeartbeatManager(OutboundLimiter *outbound)
+        : _interval(HEARTBEAT_INTERVAL), _timeout(HEARTBEAT_TIMEOUT), _outbound(outbound), _reaped(0) {}
+    // 设置心跳间隔和超时时间，需要在服务器启动前调用
+    void configure(int interval_ms, int timeout_ms)
+    {
+        _interval = interval_ms;
+        _timeout = timeout_ms;
+    }
+    int interval() { return _interval; }
+    uint64_t reaped() { return _reaped; }
+    // 长连接建立时加入管理
+    void add(const wsserver_t::connection_ptr &conn)
+    {
+        touch(conn);
+        std::lock_guard<std::mutex> lck(_mutex);
+        _conns.insert(std::make_pair(conn.get(), conn->get_handle()));
+    }
+    // 长连接断开时移除
+    void remove(const wsserver_t::connection_ptr &conn)
+    {
+        std::lock_guard<std::mutex> lck(_mutex);
+        _conns.erase(conn.get());
+    }
+    // 收到pong或消息时刷新连接的最近活跃时间
+    void touch(const wsserver_t::connection_ptr &conn)
+    {
+        conn->last_active().store(now_ms(), std::memory_order_relaxed);
+    }
+    // 遍历所有长连接：回收超时的连接，给其余的连接发送ping
+    void sweep(wsserver_t &server)
+    {
+        std::vector<websocketpp::connection_hdl> hdls;
+        {
+            std::lock_guard<std::mutex> lck(_mutex);
+            hdls.reserve(_conns.size());
+            for (auto &it : _conns)
+                hdls.push_back(it.second);
+        }
+        int64_t now = now_ms();
+        for (auto &hdl : hdls)
+        {
+            websocketpp::lib::error_code ec;
+            wsserver_t::connection_ptr conn = server.get_con_from_hdl(hdl, ec);
+            if (ec || conn.get() == nullptr)
+                continue;
+            if (now - conn->last_active().load(std::memory_order_relaxed) > _timeout)
+            {
+                ++_reaped;
+                DBG_LOG("长连接 %p 心跳超时，关闭连接", conn.get());
+                remove(conn); // 之后不再检查这个连接，close回调中再次移除也没有关系
+                conn->close(websocketpp::close::status::going_away, "heartbeat timeout", ec);
+                continue;
+            }
+            conn->ping("", ec);
+            _outbound->flush(conn); // 顺便把积压时合并保留的消息发出去
+        }
+    }
+
+private:
+    static int64_t now_ms()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+private:
+    int _interval;
+    int _timeout;
+    OutboundLimiter *_outbound;
+    std::atomic<uint64_t> _reaped; // 因心跳超时被回收的连接数
+    std::mutex _mutex;
+    std::unordered_map<void *, websocketpp::connection_hdl> _conns; // 所有长连接
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <vector>
+
+#include "message.hpp"
+#include "util.hpp"
+
+#define BOARD_ROW 19
+#define BOARD_COL 19
+
+#define GAME_MOVE_BITS 10                                          // 每步棋的编码位数：9位位置(row*BOARD_COL+col < 512) + 1位颜色
+#define GAME_MOVES_MAX ((BOARD_ROW * BOARD_COL * GAME_MOVE_BITS + 7) / 8) // 下满棋盘时编码后的字节数
+#define HISTORY_DEFAULT_LIMIT 20                                   // 对战记录每页默认的条数
+#define HISTORY_MAX_LIMIT 100                                      // 对战记录每页最多的条数
+
+JSON_KEY(color)
+JSON_KEY(end_time)
+JSON_KEY(id)
+JSON_KEY(move_count)
+JSON_KEY(moves)
+JSON_KEY(next)
+JSON_KEY(start_time)
+
+// 一局对战的完整记录，游戏结束时由房间生成，和结果一起交给写入队列
+struct GameRecord
+{
+    uint64_t white_id;
+    uint64_t black_id;
+    uint64_t winner;
+    int64_t start_time; // 开始和结束的时间(unix时间戳，秒)
+    int64_t end_time;
+    int move_count;     // 走棋的步数
+    std::string moves;  // MoveCodec编码后的走棋
+};
+
+// 一步棋
+struct GameMove
+{
+    int col;
+    int color; // 1-黑 2-白
+    int row;
+    typedef JsonSchema<GameMove,
+                       JSON_FIELD(GameMove, col),
+                       JSON_FIELD(GameMove, color),
+                       JSON_FIELD(GameMove, row)>
+        schema;
+};
+
+/**
+ * 走棋的紧凑编码：第i步占第i*GAME_MOVE_BITS开始的GAME_MOVE_BITS位(低位在前)
+ * 19x19的棋盘有361个位置，一个字节放不下，位置用9位，再加1位颜色，下满棋盘也只要GAME_MOVES_MAX个字节
+ */
+class MoveCodec
+{
+public:
+    // 在out后面追加第index步
+    static void append(std::string &out, int index, int row, int col, int color)
+    {
+        uint32_t code = (uint32_t)(row * BOARD_COL + col) << 1 | (color == 2 ? 1 : 0);
+        size_t bit = (size_t)index * GAME_MOVE_BITS;
+        out.resize((bit + GAME_MOVE_BITS + 7) / 8, '\0');
+        for (int i = 0; i < GAME_MOVE_BITS; ++i, ++bit)
+        {
+            if (code >> i & 1)
+                out[bit / 8] |= (char)(1 << (bit % 8));
+        }
+    }
+    // 解码前count步，数据不完整或者位置越界时返回false
+    static bool decode(const std::string &data, int count, std::vector<GameMove> &moves)
+    {
+        if (count < 0 || data.size() * 8 < (size_t)count * GAME_MOVE_BITS)
+            return false;
+        moves.clear();
+        moves.reserve(count);
+        size_t bit = 0;
+        for (int n = 0; n < count; ++n)
+        {
+            uint32_t code = 0;
+            for (int i = 0; i < GAME_MOVE_BITS; ++i, ++bit)
+            {
+                if ((unsigned char)data[bit / 8] >> (bit % 8) & 1)
+                    code |= 1u << i;
+            }
+            int pos = code >> 1;
+            if (pos >= BOARD_ROW * BOARD_COL)
+                return false;
+            GameMove m = {pos % BOARD_COL, (code & 1) ? 2 : 1, pos / BOARD_COL};
+            moves.push_back(m);
+        }
+        return true;
+    }
+};
+
+/* 对战记录列表中的一项
+{"black_id":2,"end_time":1718000000,"id":15,"move_count":37,"start_time":1717999000,"white_id":1,"winner":1}
+*/
+struct GameSummary
+{
+    uint64_t black_id;
+    int64_t end_time;
+    uint64_t id;
+    int move_count;
+    int64_t start_time;
+    uint64_t white_id;
+    uint64_t winner;
+    typedef JsonSchema<GameSummary,
+                       JSON_FIELD(GameSummary, black_id),
+                       JSON_FIELD(GameSummary, end_time),
+                       JSON_FIELD(GameSummary, id),
+                       JSON_FIELD(GameSummary, move_count),
+                       JSON_FIELD(GameSummary, start_time),
+                       JSON_FIELD(GameSummary, white_id),
+                       JSON_FIELD(GameSummary, winner)>
+        schema;
+};
+
+/* 对战记录的一页，按id从新到旧，next是下一页的before参数，0表示没有更多了
+{"list":[...],"next":15,"result":true}
+*/
+struct HistoryPage
+{
+    std::vector<GameSummary> list;
+    uint64_t next;
+    typedef JsonSchema<HistoryPage,
+                       JSON_FIELD(HistoryPage, list),
+                       JSON_FIELD(HistoryPage, next),
+                       JsonConstField<json_result_true>>
+        schema;
+};
+
+/* 一局对战的回放
+{"black_id":2,"end_time":...,"id":15,"moves":[{"col":9,"color":1,"row":9},...],"result":true,"start_time":...,"white_id":1,"winner":1}
+*/
+struct ReplayResp
+{
+    uint64_t black_id;
+    int64_t end_time;
+    uint64_t id;
+    std::vector<GameMove> moves;
+    int64_t start_time;
+    uint64_t white_id;
+    uint64_t winner;
+    typedef JsonSchema<ReplayResp,
+                       JSON_FIELD(ReplayResp, black_id),
+                       JSON_FIELD(ReplayResp, end_time),
+                       JSON_FIELD(ReplayResp, id),
+                       JSON_FIELD(ReplayResp, moves),
+                       JsonConstField<json_result_true>,
+                       JSON_FIELD(ReplayResp, start_time),
+                       JSON_FIELD(ReplayResp, white_id),
+                       JSON_FIELD(ReplayResp, winner)>
+        schema;
+};
@@ -1,173 +1,368 @@
 #pragma once
 
-#include <list>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <mutex>
-#include <thread>
-#include <condition_variable>
+#include <set>
+#include <unordered_map>
+#include <vector>
 
 #include "util.hpp"
+#include "message.hpp"
 #include "room.hpp"
 #include "session.hpp"
 
+#define MATCH_TICK_INTERVAL 200 // 两次批量匹配之间的间隔(ms)
+#define MATCH_WINDOW_BASE 50    // 刚开始匹配时能接受的分差
+#define MATCH_WINDOW_STEP 25    // 每等待一秒分差窗口扩大多少
+#define MATCH_WINDOW_MAX 1000   // 分差窗口的上限
+
+/**
+ * 匹配的收件队列：先进先出，同一个元素最多在队列中出现一次
+ *   - 元素同时是哈希表的key，链表的前后指针放在哈希表的节点里(侵入式链表)，
+ *     push去重、remove取消都是O(1)，不用再在锁内遍历整个链表
+ *   - 重复push返回false，客户端连续发送match_start也只排队一次，不会和自己配对
+ */
 template<class T>
 class MatchQueue
 {
 public:
-    int size()
+    MatchQueue() : _head(nullptr), _tail(nullptr) {}
+    size_t size()
     {
         std::unique_lock<std::mutex> lck(_mutex);
-        return _list.size();
+        return _index.size();
     }
     bool empty() 
     {
         std::unique_lock<std::mutex> lck(_mutex);
-        return _list.empty(); 
-    }
-    void wait()
-    {
-        std::unique_lock<std::mutex> lck(_mutex); // 这里使用unique_lock来管理是因为要让条件变量等待
-        _cond.wait(lck);
+        return _index.empty(); 
     }
-    void push(const T& data)
+    // 已经在队列中返回false
+    bool push(const T& data)
     {
         std::unique_lock<std::mutex> lck(_mutex);
-        _list.push_back(data);
-        _cond.notify_all();
+        auto ret = _index.insert(std::make_pair(data, Link()));
+        if (ret.second == false)
+            return false;
+        Entry *e = &*ret.first; // 哈希表的节点地址在删除之前不会变
+        e->second.prev = _tail;
+        e->second.next = nullptr;
+        if (_tail != nullptr)
+            _tail->second.next = e;
+        else
+            _head = e;
+        _tail = e;
+        return true;
     }
     bool pop(T &data)
     {
         std::unique_lock<std::mutex> lck(_mutex);
-        if(_list.empty()) return false;
-        data = _list.front();
-        _list.pop_front();
+        if(_head == nullptr) return false;
+        data = _head->first;
+        erase(_head);
         return true;
     }
-    void remove(const T &data)
+    // 不在队列中返回false
+    bool remove(const T &data)
     {
         std::unique_lock<std::mutex> lck(_mutex);
-        _list.remove(data);
+        auto it = _index.find(data);
+        if (it == _index.end())
+            return false;
+        erase(&*it);
+        return true;
+    }
+private:
+    struct Link;
+    typedef std::pair<const T, Link> Entry;
+    struct Link
+    {
+        Entry *prev;
+        Entry *next;
+    };
+    // 从链表中摘下并从哈希表中删除（调用时持有锁）
+    void erase(Entry *e)
+    {
+        if (e->second.prev != nullptr)
+            e->second.prev->second.next = e->second.next;
+        else
+            _head = e->second.next;
+        if (e->second.next != nullptr)
+            e->second.next->second.prev = e->second.prev;
+        else
+            _tail = e->second.prev;
+        _index.erase(_index.find(e->first)); // 按迭代器删除，避免引用节点自己的key
     }
 private:
-    std::list<T> _list;
+    std::unordered_map<T, Link> _index;
+    Entry *_head; // 队头，最早push的
+    Entry *_tail;
     std::mutex _mutex;
-    std::condition_variable _cond;
 };
 
+// 等待匹配的玩家
+struct MatchEntry
+{
+    uint64_t uid;
+    int socre;
+    int64_t since; // 开始等待的时间(ms)
+};
+
+/**
+ * 按天梯分数排序的匹配池(不加锁，由MatchManager加锁使用)
+ *   - 玩家按(分数, uid)放在有序集合中，另外用uid索引，加入和取消都是O(log n)
+ *   - 每个玩家能接受的分差随等待时间扩大：MATCH_WINDOW_BASE + MATCH_WINDOW_STEP * 等待秒数，最多MATCH_WINDOW_MAX
+ *   - 每次批量匹配：分数最接近的一定是排序后相邻的两个人，相邻两人的分差不超过其中较大的窗口就可以配对；
+ *     所有可以配对的相邻两人按分差从小到大挑选，每个人只配对一次，没配上的等下一次窗口更大时再匹配
+ */
+class RatingPool
+{
+public:
+    size_t size() { return _users.size(); }
+    bool empty() { return _users.empty(); }
+    bool contains(uint64_t uid) { return _users.find(uid) != _users.end(); }
+    // 已经在池中时只更新分数，保留原来的等待时间
+    void insert(const MatchEntry &e)
+    {
+        auto it = _users.find(e.uid);
+        if (it != _users.end())
+        {
+            _order.erase(std::make_pair(it->second.socre, e.uid));
+            it->second.socre = e.socre;
+        }
+        else
+        {
+            _users.insert(std::make_pair(e.uid, e));
+        }
+        _order.insert(std::make_pair(e.socre, e.uid));
+    }
+    bool remove(uint64_t uid)
+    {
+        auto it = _users.find(uid);
+        if (it == _users.end())
+            return false;
+        _order.erase(std::make_pair(it->second.socre, uid));
+        _users.erase(it);
+        return true;
+    }
+    // 进行一次批量匹配，配对的玩家从池中删除并放到pairs中
+    void match(int64_t now, std::vector<std::pair<MatchEntry, MatchEntry>> &pairs)
+    {
+        struct Candidate
+        {
+            int diff;
+            uint64_t uid1, uid2;
+            bool operator<(const Candidate &o) const { return diff < o.diff; }
+        };
+        std::vector<Candidate> cands;
+        const std::pair<int, uint64_t> *prev = nullptr;
+        for (auto &cur : _order)
+        {
+            if (prev != nullptr)
+            {
+                int diff = cur.first - prev->first;
+                if (diff <= std::max(window(prev->second, now), window(cur.second, now)))
+                {
+                    Candidate c = {diff, prev->second, cur.second};
+                    cands.push_back(c);
+                }
+            }
+            prev = &cur;
+        }
+        std::stable_sort(cands.begin(), cands.end());
+        for (auto &c : cands)
+        {
+            auto it1 = _users.find(c.uid1), it2 = _users.find(c.uid2);
+            if (it1 == _users.end() || it2 == _users.end())
+                continue; // 已经和另一边的邻居配对了
+            pairs.push_back(std::make_pair(it1->second, it2->second));
+            remove(c.uid1);
+            remove(c.uid2);
+        }
+    }
+
+private:
+    int window(uint64_t uid, int64_t now)
+    {
+        int64_t waited = now - _users[uid].since;
+        int64_t w = MATCH_WINDOW_BASE + MATCH_WINDOW_STEP * waited / 1000;
+        return (int)std::min<int64_t>(w, MATCH_WINDOW_MAX);
+    }
+
+private:
+    std::set<std::pair<int, uint64_t>> _order;        // (分数, uid)
+    std::unordered_map<uint64_t, MatchEntry> _users;  // uid -> 等待信息
+};
 
+/**
+ * 游戏匹配：不创建线程，匹配任务都在服务器的io_service上执行
+ *   - match_start时uid放进收件队列_inbox；没有在计时的话启动定时器，MATCH_TICK_INTERVAL内开始匹配的人一起处理
+ *   - 定时器到期后在匹配模块的strand上：取出收件队列中的玩家查询分数放进匹配池，对整个匹配池做一次批量匹配；
+ *     池中还有人就继续计时，没有人就停止，空闲时没有任何任务
+ *   - 匹配池只在strand上访问，不需要加锁；match_stop时从收件队列删除，并投递到strand上从匹配池删除
+ *   - 匹配成功的消息投递到各自连接的strand上发送，和这个连接上的其他读写串行执行
+ * 不论将来分几个档次匹配，都只是多几个匹配池，不会增加线程
+ */
 class MatchManager
 {
 public:
-    MatchManager(UserTable *ut, OnlineManager *om, RoomManager *rm) 
-        : _rm(rm), _om(om), _ut(ut) 
-        ,_th_normal(std::thread(&MatchManager::th_normal_entery,this))
-        ,_th_high(std::thread(&MatchManager::th_high_entery,this))
-        ,_th_super(std::thread(&MatchManager::th_super_entery,this))
+    MatchManager(UserStore *ut, OnlineManager *om, RoomManager *rm, OutboundLimiter *outbound,
+                 websocketpp::lib::asio::io_service *ios) 
+        : _om(om), _rm(rm), _ut(ut), _outbound(outbound), _strand(*ios), _timer(*ios), _armed(false), _stopped(false), _waiting(0)
     {
         DBG_LOG("游戏匹配模块初始化成功");
     }
     ~MatchManager()
     {
+        stop();
+        websocketpp::lib::asio::error_code ec;
+        _timer.cancel(ec); // 这时事件循环已经退出，可以直接取消
         DBG_LOG("游戏匹配模块销毁成功");
     }
-    bool add(uint64_t uid)
+    void add(uint64_t uid)
     {
-        // 1. 获取用户信息
-        Json::Value user;
-        bool ret = _ut->select_by_id(uid, user);
-        if(ret == false)
-        { 
-            DBG_LOG("获取玩家 %lu 信息失败", uid);
-            return false;
-        }
-        // 根据分数放进不同档次的阻塞队列
-        int score = user["score"].asInt();
-        if(score < 2000)
-            _q_normal.push(uid);
-        else if(score >= 2000 && score < 3000)
-            _q_high.push(uid);
-        else
-            _q_super.push(uid);
-        return true;
+        if (_inbox.push(uid))
+            schedule();
     }
-    bool del(uint64_t uid)
+    void del(uint64_t uid)
     {
-        // 1. 获取用户信息
-        Json::Value user;
-        bool ret = _ut->select_by_id(uid, user);
-        if(ret == false)
-        { 
-            DBG_LOG("获取玩家 %lu 信息失败", uid);
-            return false;
-        }
-        // 根据分数查找不同档次的阻塞队列
-        int score = user["score"].asInt();
-        if(score < 2000)
-            _q_normal.remove(uid);
-        else if(score >= 2000 && score < 3000)
-            _q_high.remove(uid);
-        else
-            _q_super.remove(uid);
+        if (_inbox.remove(uid))
+            return; // 还没有进入匹配池
+        _strand.post([this, uid]() {
+            // 投递之后玩家可能又开始了匹配，并且已经在这之前的批量匹配中回到了匹配池，这时不能删除
+            if (_om->state(uid) != PRESENCE_MATCHING && _pool.remove(uid))
+                --_waiting;
+        });
+    }
+    // 停止匹配：之后不再开始新的匹配，正在计时的定时器到期后不再继续
+    void stop() { _stopped = true; }
+    // 正在等待匹配的人数
+    size_t size()
+    {
+        return _waiting + _inbox.size();
     }
 private:
-    void handle_match(MatchQueue<uint64_t> &mq)
+    static int64_t now_ms()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+    // 没有在计时就开始计时，已经在计时的话这次开始匹配的玩家会在下一次批量匹配中处理
+    void schedule()
+    {
+        if (_stopped || _armed.exchange(true))
+            return;
+        _strand.post(std::bind(&MatchManager::arm, this));
+    }
+    // 在strand上执行
+    void arm()
     {
-        while(true)
+        _timer.expires_from_now(std::chrono::milliseconds(MATCH_TICK_INTERVAL));
+        _timer.async_wait(_strand.wrap(std::bind(&MatchManager::tick, this, std::placeholders::_1)));
+    }
+    // 从内存中的排行榜取分数放进匹配池(strand运行在事件循环上，不能查询数据库)，已经取消匹配的不再放入
+    void enter_pool(uint64_t uid, int64_t since)
+    {
+        int socre = DEFAULT_SOCRE;
+        if (_ut->leaderboard().socre(uid, socre) == false)
+            DBG_LOG("玩家 %lu 不在排行榜中，按默认分数匹配", uid);
+        back_to_pool(MatchEntry{uid, socre, since});
+    }
+    // 配对之后发现对方已经不能开始游戏，还在匹配的玩家按原来的等待时间回到匹配池
+    void back_to_pool(const MatchEntry &e)
+    {
+        if (_om->state(e.uid) != PRESENCE_MATCHING || _pool.contains(e.uid))
+            return;
+        _pool.insert(e);
+        ++_waiting;
+    }
+    // 在连接自己的strand上发送，没有strand(单线程配置)时直接发送
+    void send(const wsserver_t::connection_ptr &conn, const std::string &body)
+    {
+        OutboundLimiter *outbound = _outbound;
+        auto task = [outbound, conn, body]() { outbound->send(conn, body); };
+        wsserver_t::connection_type::strand_ptr strand = conn->get_strand();
+        if (strand)
+            strand->post(task);
+        else
+            task();
+    }
+    // 放弃占用：还在大厅的玩家恢复为匹配中并回到匹配池，已经离开大厅的不再处理
+    void unclaim(const MatchEntry &e)
+    {
+        if (_om->transition(e.uid, PRESENCE_HALL, PRESENCE_MATCHING))
+            back_to_pool(e);
+    }
+    void handle_pair(const MatchEntry &e1, const MatchEntry &e2)
+    {
+        // 1. 用MATCHING->HALL的状态转换占用两个玩家：转换成功之后玩家不能再取消匹配，检查和占用是同一次操作
+        //    有人已经掉线或者取消了匹配，就把另一个放回匹配池
+        if (_om->transition(e1.uid, PRESENCE_MATCHING, PRESENCE_HALL) == false)
         {
-            // 1. 人数小于2，就阻塞等待
-            while(mq.size() < 2)
-            {
-                mq.wait(); // 阻塞等待，直到有人进入就唤醒，然后进行检测
-            }
-            // 2. 人数大于等于2，出队两个玩家
-            uint64_t uid1, uid2;
-            bool ret = mq.pop(uid1);
-            if(ret ==false) continue;
-            ret = mq.pop(uid2);
-            if(ret ==false) { add(uid1); continue;} // 当uid1出队列之后如果uid2掉线了，让uid1还要重新入队列
-            // 3. 校验出队的两个玩家的在线状态，如果有人掉线，就让在线的重新进队列等待匹配
-            wsserver_t::connection_ptr conn1 = _om->get_conn_from_hall(uid1);
-            if(conn1.get() == nullptr)
-            {
-                add(uid2);
-                continue;
-            }
-            wsserver_t::connection_ptr conn2 = _om->get_conn_from_hall(uid2);
-            if(conn2.get() == nullptr)
-            {
-                add(uid1);
-                continue;
-            }
-            // 4. 为两个玩家创建房间，将玩家加入房间
-            room_ptr rp = _rm->createRoom(uid1, uid2);
-            if(rp.get() == nullptr)
-            {
-                // 如果房间没有创建成功，就让两个玩家重新进入匹配队列进行匹配
-                add(uid1);
-                add(uid2);
-                continue;
-            }
-            // 5. 服务端建立房间，两个玩家进入房间成功后，给两个玩家响应
-            Json::Value resp;
-            resp["room_id"] = Json::UInt64(rp->id());
-            resp["optype"] = "match_success";
-            resp["result"] = true;
-            std::string body;
-            JsonUtil::serialize(resp, &body);
-            conn1->send(body);
-            conn2->send(body);
+            back_to_pool(e2);
+            return;
+        }
+        if (_om->transition(e2.uid, PRESENCE_MATCHING, PRESENCE_HALL) == false)
+        {
+            unclaim(e1);
+            return;
+        }
+        // 2. 为两个玩家创建房间，将玩家加入房间
+        wsserver_t::connection_ptr conn1 = _om->get_conn_from_hall(e1.uid);
+        wsserver_t::connection_ptr conn2 = _om->get_conn_from_hall(e2.uid);
+        room_ptr rp;
+        if (conn1.get() != nullptr && conn2.get() != nullptr)
+            rp = _rm->createRoom(e1.uid, e2.uid);
+        if(rp.get() == nullptr)
+        {
+            // 如果房间没有创建成功(比如有人刚好断开)，就让还在大厅的玩家回到匹配池
+            unclaim(e1);
+            unclaim(e2);
+            return;
         }
+        // 3. 服务端建立房间，给两个玩家响应
+        MatchSuccessResp resp = {rp->id()};
+        std::string body;
+        json_encode(resp, body);
+        send(conn1, body);
+        send(conn2, body);
+    }
+    // 定时器到期，在strand上执行一次批量匹配
+    void tick(const websocketpp::lib::asio::error_code &ec)
+    {
+        if (ec || _stopped)
+            return; // 定时器被取消
+        // 1. 收件队列中的玩家放进匹配池
+        int64_t now = now_ms();
+        uint64_t uid;
+        while (_inbox.pop(uid))
+            enter_pool(uid, now);
+        // 2. 对整个匹配池做一次批量匹配
+        std::vector<std::pair<MatchEntry, MatchEntry>> pairs;
+        _pool.match(now, pairs);
+        _waiting -= pairs.size() * 2;
+        for (auto &p : pairs)
+            handle_pair(p.first, p.second);
+        // 3. 池中还有人就继续计时；先清除标记再检查收件队列，检查之后push的玩家会自己重新开始计时
+        if (_pool.empty() == false)
+            return arm();
+        _armed = false;
+        if (_inbox.empty() == false)
+            schedule();
     }
-    void th_normal_entery() { return handle_match(_q_normal); }
-    void th_high_entery() { return handle_match(_q_high); }
-    void th_super_entery() { return handle_match(_q_super); }
 private:
-    MatchQueue<uint64_t> _q_normal;
-    MatchQueue<uint64_t> _q_high;
-    MatchQueue<uint64_t> _q_super;
-    std::thread _th_normal;
-    std::thread _th_high;
-    std::thread _th_super;
     OnlineManager *_om;
     RoomManager *_rm;
-    UserTable *_ut;
+    UserStore *_ut;
+    OutboundLimiter *_outbound;
+    MatchQueue<uint64_t> _inbox;   // 开始匹配的玩家，在下一次批量匹配时放进匹配池
+    RatingPool _pool;              // 只在_strand上访问
+    websocketpp::lib::asio::io_service::strand _strand; // 串行化所有匹配任务的strand
+    websocketpp::lib::asio::steady_timer _timer;        // 批量匹配的定时器，只在_strand上设置
+    std::atomic<bool> _armed;      // 定时器是否在计时(或者即将开始计时)
+    std::atomic<bool> _stopped;
+    std::atomic<size_t> _waiting;  // 匹配池中的人数
 };
@@ -0,0 +1,414 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "store.hpp"
+#include "util.hpp"
+
+/**
+ * UserStore的进程内实现：用户、对战记录都放在哈希表/数组中，一把锁保护，不依赖任何外部服务
+ * 用于压测和没有数据库的机器，测出来的是服务器本身的吞吐，不受数据库的影响
+ *   - path为空时只保存在内存中，进程退出就丢失
+ *   - path不为空时每次修改先追加到文件(write到内核，进程崩溃不会丢失)，启动时重放文件恢复全部数据
+ *     一批对战结果编码成一次write，重放时末尾不完整的记录被截掉
+ */
+class MemoryUserStore : public UserStore
+{
+public:
+    MemoryUserStore(const std::string &path = std::string())
+        : _path(path), _fd(-1), _broken(false), _next_id(1), _checkpoint(0)
+    {
+        load();
+    }
+    ~MemoryUserStore()
+    {
+        if (_fd >= 0)
+            close(_fd);
+    }
+
+    bool insert(Json::Value &user) override
+    {
+        std::string username = user["username"].asString();
+        std::lock_guard<std::mutex> lck(_mutex);
+        if (_names.find(username) != _names.end())
+        {
+            DBG_LOG("user:%s is already exists", username.c_str());
+            return false;
+        }
+        uint64_t id = _next_id;
+        User u = {username, hash_password(user["password"].asString()), DEFAULT_SOCRE, 0, 0};
+        std::string rec;
+        put_user(rec, id, u);
+        if (append(rec) == false)
+            return false;
+        add_user(id, u);
+        _rank.set(id, username, DEFAULT_SOCRE);
+        return true;
+    }
+    bool login(Json::Value &user) override
+    {
+        std::lock_guard<std::mutex> lck(_mutex);
+        auto it = _names.find(user["username"].asString());
+        if (it == _names.end() || _users[it->second].password != hash_password(user["password"].asString()))
+        {
+            DBG_LOG("user login fail");
+            return false;
+        }
+        User &u = _users[it->second];
+        user["id"] = Json::Value::UInt64(it->second);
+        user["socre"] = u.socre;
+        user["total_count"] = u.total_count;
+        user["win_count"] = u.win_count;
+        return true;
+    }
+    bool select_by_name(const std::string &username, Json::Value &user) override
+    {
+        std::lock_guard<std::mutex> lck(_mutex);
+        auto it = _names.find(username);
+        if (it == _names.end())
+            return false;
+        to_json(it->second, _users[it->second], user);
+        return true;
+    }
+    bool select_by_id(uint64_t id, Json::Value &user) override
+    {
+        std::lock_guard<std::mutex> lck(_mutex);
+        auto it = _users.find(id);
+        if (it == _users.end())
+            return false;
+        to_json(id, it->second, user);
+        return true;
+    }
+    bool win(uint64_t id) override { return change(id, ADD_SOCRE, 1, 1); }
+    bool lose(uint64_t id) override { return change(id, 0, 1, 0); }
+    bool apply_results(const std::vector<GameResult> &results) override
+    {
+        std::unordered_map<uint64_t, Delta> deltas;
+        uint64_t last_seq = 0;
+        for (auto &r : results)
+        {
+            Delta &w = deltas[r.winner];
+            w.socre += ADD_SOCRE;
+            w.total_count += 1;
+            w.win_count += 1;
+            deltas[r.loser].total_count += 1;
+            last_seq = std::max(last_seq, r.seq);
+        }
+        std::lock_guard<std::mutex> lck(_mutex);
+        // 整批结果编码成一次write，然后再修改内存
+        std::string rec;
+        for (auto &it : deltas)
+        {
+            if (_users.find(it.first) != _users.end())
+                put_delta(rec, it.first, it.second);
+        }
+        uint64_t game_id = _games.size();
+        for (auto &r : results)
+        {
+            if (r.game.winner != 0)
+                put_game(rec, ++game_id, r.game);
+        }
+        put_checkpoint(rec, std::max(last_seq, _checkpoint));
+        if (append(rec) == false)
+            return false;
+        replay_records(rec);
+        for (auto &it : deltas)
+        {
+            if (it.second.socre != 0)
+                _rank.add(it.first, it.second.socre);
+        }
+        return true;
+    }
+    bool result_checkpoint(uint64_t &seq) override
+    {
+        std::lock_guard<std::mutex> lck(_mutex);
+        seq = _checkpoint;
+        return true;
+    }
+    bool history(uint64_t uid, uint64_t before, int limit, std::vector<GameSummary> &list) override
+    {
+        list.clear();
+        std::lock_guard<std::mutex> lck(_mutex);
+        auto it = _user_games.find(uid);
+        if (it == _user_games.end())
+            return true;
+        // 每个用户的对战记录id是递增的，二分找到before的位置往前取
+        const std::vector<uint64_t> &ids = it->second;
+        for (auto pos = std::lower_bound(ids.begin(), ids.end(), before); pos != ids.begin() && (int)list.size() < limit;)
+        {
+            --pos;
+            const GameRecord &g = _games[*pos - 1];
+            GameSummary s = {g.black_id, g.end_time, *pos, g.move_count, g.start_time, g.white_id, g.winner};
+            list.push_back(s);
+        }
+        return true;
+    }
+    bool replay(uint64_t id, GameRecord &game) override
+    {
+        std::lock_guard<std::mutex> lck(_mutex);
+        if (id == 0 || id > _games.size())
+            return false;
+        game = _games[id - 1];
+        return true;
+    }
+    // 没有连接池，不需要输出统计
+    void log_stats() override {}
+
+private:
+    struct User
+    {
+        std::string username;
+        uint64_t password; // 密码的哈希值，这个实现只用于测试，不是安全的密码哈希
+        int socre;
+        int total_count;
+        int win_count;
+    };
+    struct Delta
+    {
+        Delta() : socre(0), total_count(0), win_count(0) {}
+        int socre;
+        int total_count;
+        int win_count;
+    };
+    // 文件中每条记录是: 4字节长度 + 1字节类型 + 内容
+    typedef enum
+    {
+        REC_USER = 1,   // 新增用户
+        REC_DELTA,      // 积分和场数的变化
+        REC_GAME,       // 对战记录
+        REC_CHECKPOINT  // 结果检查点
+    } RecordType_t;
+
+    static uint64_t hash_password(const std::string &password) { return std::hash<std::string>()(password); }
+    static void to_json(uint64_t id, const User &u, Json::Value &user)
+    {
+        user["id"] = Json::Value::UInt64(id);
+        user["username"] = u.username;
+        user["socre"] = u.socre;
+        user["total_count"] = u.total_count;
+        user["win_count"] = u.win_count;
+    }
+    void add_user(uint64_t id, const User &u)
+    {
+        _users[id] = u;
+        _names[u.username] = id;
+        _next_id = std::max(_next_id, id + 1);
+    }
+    bool change(uint64_t id, int socre, int total_count, int win_count)
+    {
+        std::lock_guard<std::mutex> lck(_mutex);
+        if (_users.find(id) == _users.end())
+            return false;
+        Delta d;
+        d.socre = socre;
+        d.total_count = total_count;
+        d.win_count = win_count;
+        std::string rec;
+        put_delta(rec, id, d);
+        if (append(rec) == false)
+            return false;
+        replay_records(rec);
+        if (socre != 0)
+            _rank.add(id, socre);
+        return true;
+    }
+
+    // 编码
+    static void put(std::string &out, uint64_t v) { out.append((const char *)&v, sizeof(v)); }
+    static void put(std::string &out, const std::string &s)
+    {
+        put(out, (uint64_t)s.size());
+        out.append(s);
+    }
+    static size_t begin_record(std::string &out, RecordType_t type)
+    {
+        size_t start = out.size();
+        out.append(4, '\0');
+        out.push_back((char)type);
+        return start;
+    }
+    static void end_record(std::string &out, size_t start)
+    {
+        uint32_t len = out.size() - start - 4;
+        memcpy(&out[start], &len, sizeof(len));
+    }
+    static void put_user(std::string &out, uint64_t id, const User &u)
+    {
+        size_t start = begin_record(out, REC_USER);
+        put(out, id);
+        put(out, u.username);
+        put(out, u.password);
+        end_record(out, start);
+    }
+    static void put_delta(std::string &out, uint64_t id, const Delta &d)
+    {
+        size_t start = begin_record(out, REC_DELTA);
+        put(out, id);
+        put(out, (uint64_t)(int64_t)d.socre);
+        put(out, (uint64_t)d.total_count);
+        put(out, (uint64_t)d.win_count);
+        end_record(out, start);
+    }
+    static void put_game(std::string &out, uint64_t id, const GameRecord &g)
+    {
+        size_t start = begin_record(out, REC_GAME);
+        put(out, id);
+        put(out, g.white_id);
+        put(out, g.black_id);
+        put(out, g.winner);
+        put(out, (uint64_t)g.start_time);
+        put(out, (uint64_t)g.end_time);
+        put(out, (uint64_t)g.move_count);
+        put(out, g.moves);
+        end_record(out, start);
+    }
+    static void put_checkpoint(std::string &out, uint64_t seq)
+    {
+        size_t start = begin_record(out, REC_CHECKPOINT);
+        put(out, seq);
+        end_record(out, start);
+    }
+
+    // 解码
+    static bool get(const std::string &data, size_t &pos, size_t end, uint64_t &v)
+    {
+        if (end - pos < sizeof(v))
+            return false;
+        memcpy(&v, data.data() + pos, sizeof(v));
+        pos += sizeof(v);
+        return true;
+    }
+    static bool get(const std::string &data, size_t &pos, size_t end, std::string &s)
+    {
+        uint64_t len = 0;
+        if (get(data, pos, end, len) == false || end - pos < len)
+            return false;
+        s.assign(data, pos, len);
+        pos += len;
+        return true;
+    }
+    // 把编码好的记录应用到内存中(调用时持有_mutex)，返回完整解析的字节数
+    size_t replay_records(const std::string &data)
+    {
+        size_t pos = 0;
+        while (data.size() - pos >= 5)
+        {
+            uint32_t len = 0;
+            memcpy(&len, data.data() + pos, sizeof(len));
+            if (len == 0 || data.size() - pos - 4 < len)
+                break;
+            size_t p = pos + 5, end = pos + 4 + len;
+            RecordType_t type = (RecordType_t)data[pos + 4];
+            uint64_t id = 0, a = 0, b = 0, c = 0;
+            if (type == REC_USER)
+            {
+                User u = {"", 0, DEFAULT_SOCRE, 0, 0};
+                if (!get(data, p, end, id) || !get(data, p, end, u.username) || !get(data, p, end, u.password))
+                    break;
+                add_user(id, u);
+            }
+            else if (type == REC_DELTA)
+            {
+                if (!get(data, p, end, id) || !get(data, p, end, a) || !get(data, p, end, b) || !get(data, p, end, c))
+                    break;
+                User &u = _users[id];
+                u.socre += (int)(int64_t)a;
+                u.total_count += (int)b;
+                u.win_count += (int)c;
+            }
+            else if (type == REC_GAME)
+            {
+                GameRecord g;
+                uint64_t start_time = 0, end_time = 0, move_count = 0;
+                if (!get(data, p, end, id) || !get(data, p, end, g.white_id) || !get(data, p, end, g.black_id) ||
+                    !get(data, p, end, g.winner) || !get(data, p, end, start_time) || !get(data, p, end, end_time) ||
+                    !get(data, p, end, move_count) || !get(data, p, end, g.moves) || id != _games.size() + 1)
+                    break;
+                g.start_time = (int64_t)start_time;
+                g.end_time = (int64_t)end_time;
+                g.move_count = (int)move_count;
+                _games.push_back(std::move(g));
+                _user_games[_games.back().white_id].push_back(id);
+                _user_games[_games.back().black_id].push_back(id);
+            }
+            else if (type == REC_CHECKPOINT)
+            {
+                if (!get(data, p, end, _checkpoint))
+                    break;
+            }
+            else
+            {
+                break;
+            }
+            pos = end;
+        }
+        return pos;
+    }
+    // 打开文件，重放全部记录，截掉末尾不完整的记录
+    void load()
+    {
+        if (_path.empty())
+            return;
+        _fd = open(_path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (_fd < 0)
+        {
+            ERR_LOG("打开用户数据文件 %s 失败，数据只保存在内存中", _path.c_str());
+            return;
+        }
+        std::string data;
+        char buf[65536];
+        ssize_t n;
+        while ((n = read(_fd, buf, sizeof(buf))) > 0)
+            data.append(buf, n);
+        size_t pos = replay_records(data);
+        if (pos != data.size())
+        {
+            ERR_LOG("用户数据文件 %s 末尾有 %lu 字节不完整的记录，已截掉", _path.c_str(), (unsigned long)(data.size() - pos));
+            if (ftruncate(_fd, pos) != 0)
+                ERR_LOG("截断用户数据文件失败");
+        }
+        for (auto &it : _users)
+            _rank.set(it.first, it.second.username, it.second.socre);
+        INF_LOG("从 %s 加载了 %lu 个用户，%lu 局对战记录", _path.c_str(), (unsigned long)_users.size(),
+                (unsigned long)_games.size());
+    }
+    // 追加记录到文件(调用时持有_mutex)
+    // 写入不完整时截断回写入之前的长度，否则之后的记录都接在残缺的记录后面，重启时会被当作损坏的尾部一起截掉
+    bool append(const std::string &rec)
+    {
+        if (_fd < 0)
+            return true;
+        if (_broken)
+            return false;
+        off_t offset = lseek(_fd, 0, SEEK_END);
+        if (offset >= 0 && write(_fd, rec.data(), rec.size()) == (ssize_t)rec.size())
+            return true;
+        if (offset < 0 || ftruncate(_fd, offset) != 0)
+        {
+            ERR_LOG("写入用户数据文件失败并且无法恢复，之后的修改都会失败");
+            _broken = true;
+            return false;
+        }
+        ERR_LOG("写入用户数据文件失败");
+        return false;
+    }
+
+private:
+    std::string _path;                                    // 追加写的文件，为空时只保存在内存中
+    int _fd;
+    bool _broken;                                         // 文件末尾有无法截断的残缺记录，不能再追加
+    std::mutex _mutex;
+    uint64_t _next_id;                                    // 下一个注册用户的id
+    uint64_t _checkpoint;                                 // 已经写入的最大结果序号
+    std::unordered_map<uint64_t, User> _users;            // id -> 用户
+    std::unordered_map<std::string, uint64_t> _names;     // username -> id
+    std::vector<GameRecord> _games;                       // 对战记录，id是下标+1
+    std::unordered_map<uint64_t, std::vector<uint64_t>> _user_games; // uid -> 参与的对战记录id(递增)
+};
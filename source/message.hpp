@@ -0,0 +1,391 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * 固定格式协议消息的JSON编码
+ * 每种消息是一个普通的结构体，它的JSON格式由字段表(schema)在编译期确定：
+ *   键名连同引号和冒号都是编译期常量，编码时直接追加到输出缓冲区，不构建Json::Value树，也没有逐字段的内存分配
+ * 输出和JsonUtil::serialize(紧凑格式)逐字节一致：字段表按键名的字典序排列(jsoncpp按字典序输出对象的键)，
+ * 字符串的转义规则也和jsoncpp相同（非ASCII字符输出为\uXXXX）
+ * 需要jsoncpp >= 1.9：更早的版本(比如CentOS 7自带的0.10)把非ASCII字符原样输出为UTF-8，
+ * 这时两者只在中文等字符的写法上不同，都是合法的JSON，客户端解析的结果相同，但不再逐字节一致，Message_test会失败
+ */
+
+// 声明一个键：key_<name>::str() 为 "name": ，len() 为其长度
+#define JSON_KEY(name)                                                      \
+    struct key_##name                                                       \
+    {                                                                       \
+        static const char *str() { return "\"" #name "\":"; }               \
+        static size_t len() { return sizeof("\"" #name "\":") - 1; }       \
+    };
+
+// 声明一个固定的键值对，如 "optype":"put_chess"
+#define JSON_CONST(name, key, value)                                        \
+    struct name                                                             \
+    {                                                                       \
+        static const char *str() { return "\"" key "\":" value; }           \
+        static size_t len() { return sizeof("\"" key "\":" value) - 1; }    \
+    };
+
+// 字段表中的一项：结构体成员
+#define JSON_FIELD(Msg, member) JsonField<Msg, decltype(Msg::member), &Msg::member, key_##member>
+
+class JsonWriter
+{
+public:
+    static void put(std::string &out, bool v) { v ? out.append("true", 4) : out.append("false", 5); }
+    static void put(std::string &out, int v) { put(out, (int64_t)v); }
+    static void put(std::string &out, int64_t v)
+    {
+        if (v < 0)
+        {
+            out.push_back('-');
+            return put(out, (uint64_t)0 - (uint64_t)v);
+        }
+        put(out, (uint64_t)v);
+    }
+    static void put(std::string &out, uint64_t v)
+    {
+        char buf[20];
+        int n = 0;
+        do
+        {
+            buf[n++] = (char)('0' + v % 10);
+            v /= 10;
+        } while (v != 0);
+        while (n > 0)
+            out.push_back(buf[--n]);
+    }
+    static void put(std::string &out, const std::string &s) { put_string(out, s.data(), s.size()); }
+    static void put(std::string &out, const char *s) { put_string(out, s, strlen(s)); }
+    // 消息数组
+    template <class Msg>
+    static void put(std::string &out, const std::vector<Msg> &list)
+    {
+        out.push_back('[');
+        for (size_t i = 0; i < list.size(); ++i)
+        {
+            if (i != 0)
+                out.push_back(',');
+            out.push_back('{');
+            Msg::schema::write(list[i], out);
+            out.push_back('}');
+        }
+        out.push_back(']');
+    }
+
+private:
+    // 和jsoncpp(emitUTF8=false)相同的字符串转义
+    static void put_string(std::string &out, const char *s, size_t len)
+    {
+        out.push_back('"');
+        const unsigned char *p = (const unsigned char *)s, *end = p + len;
+        while (p < end)
+        {
+            unsigned char ch = *p;
+            switch (ch)
+            {
+            case '"': out.append("\\\"", 2); ++p; continue;
+            case '\\': out.append("\\\\", 2); ++p; continue;
+            case '\b': out.append("\\b", 2); ++p; continue;
+            case '\f': out.append("\\f", 2); ++p; continue;
+            case '\n': out.append("\\n", 2); ++p; continue;
+            case '\r': out.append("\\r", 2); ++p; continue;
+            case '\t': out.append("\\t", 2); ++p; continue;
+            default: break;
+            }
+            if (ch < 0x20)
+            {
+                put_hex16(out, ch);
+                ++p;
+                continue;
+            }
+            if (ch < 0x80)
+            {
+                // 连续的普通ASCII字符一次追加
+                const unsigned char *q = p;
+                while (q < end && *q >= 0x20 && *q < 0x80 && *q != '"' && *q != '\\')
+                    ++q;
+                out.append((const char *)p, q - p);
+                p = q;
+                continue;
+            }
+            uint32_t cp = decode_utf8(p, end);
+            if (cp >= 0x10000)
+            {
+                cp -= 0x10000;
+                put_hex16(out, 0xD800 + ((cp >> 10) & 0x3FF)); // 超出U+10FFFF的码点和jsoncpp一样截断
+                put_hex16(out, 0xDC00 + (cp & 0x3FF));
+            }
+            else
+            {
+                put_hex16(out, cp);
+            }
+        }
+        out.push_back('"');
+    }
+    static void put_hex16(std::string &out, uint32_t v)
+    {
+        static const char hex[] = "0123456789abcdef";
+        char buf[6] = {'\\', 'u', hex[(v >> 12) & 0xF], hex[(v >> 8) & 0xF], hex[(v >> 4) & 0xF], hex[v & 0xF]};
+        out.append(buf, 6);
+    }
+    // 解码一个UTF-8字符并前移p，非法序列和jsoncpp(utf8ToCodepoint)的处理完全一致：
+    //   - 首字节只按大小分类：0x80~0xDF都当作2字节序列(包括单独的后续字节)，0xF8以上是1字节的U+FFFD
+    //   - 后续字节不检查高两位；剩下的字节不够时只前移1个字节，输出U+FFFD
+    //   - 超长编码(2字节小于0x80、3字节小于0x800、4字节小于0x10000)和3字节的代理项输出U+FFFD，仍然前移整个序列
+    static uint32_t decode_utf8(const unsigned char *&p, const unsigned char *end)
+    {
+        unsigned char c = *p;
+        int n = c < 0xE0 ? 2 : (c < 0xF0 ? 3 : (c < 0xF8 ? 4 : 0));
+        if (n == 0 || end - p < n)
+        {
+            ++p;
+            return 0xFFFD;
+        }
+        uint32_t cp = n == 4 ? (c & 0x07) : (n == 3 ? (c & 0x0F) : (c & 0x1F));
+        for (int i = 1; i < n; ++i)
+            cp = (cp << 6) | (p[i] & 0x3F);
+        p += n;
+        static const uint32_t min_cp[5] = {0, 0, 0x80, 0x800, 0x10000};
+        if (cp < min_cp[n] || (n == 3 && cp >= 0xD800 && cp <= 0xDFFF))
+            return 0xFFFD;
+        return cp;
+    }
+};
+
+// 字段：把msg.*Member按照键Key输出
+template <class Msg, class T, T Msg::*Member, class Key>
+struct JsonField
+{
+    static void write(const Msg &msg, std::string &out)
+    {
+        out.append(Key::str(), Key::len());
+        JsonWriter::put(out, msg.*Member);
+    }
+};
+
+// 常量字段：整段输出编译期确定的文本
+template <class Text>
+struct JsonConstField
+{
+    template <class Msg>
+    static void write(const Msg &, std::string &out) { out.append(Text::str(), Text::len()); }
+};
+
+// 字段表：依次输出每个字段，字段之间用逗号分隔
+template <class Msg, class... Fields>
+struct JsonSchema;
+template <class Msg>
+struct JsonSchema<Msg>
+{
+    static void write(const Msg &, std::string &, bool) {}
+};
+template <class Msg, class F, class... Rest>
+struct JsonSchema<Msg, F, Rest...>
+{
+    static void write(const Msg &msg, std::string &out, bool first = true)
+    {
+        if (!first)
+            out.push_back(',');
+        F::write(msg, out);
+        JsonSchema<Msg, Rest...>::write(msg, out, false);
+    }
+};
+
+// 把消息编码成JSON，覆盖写入out（out已有的容量会被复用）
+template <class Msg>
+void json_encode(const Msg &msg, std::string &out)
+{
+    out.clear();
+    out.push_back('{');
+    Msg::schema::write(msg, out);
+    out.push_back('}');
+}
+template <class Msg>
+std::string json_encode(const Msg &msg)
+{
+    std::string out;
+    json_encode(msg, out);
+    return out;
+}
+
+JSON_KEY(black_id)
+JSON_KEY(col)
+JSON_KEY(list)
+JSON_KEY(message)
+JSON_KEY(optype)
+JSON_KEY(reason)
+JSON_KEY(result)
+JSON_KEY(room_id)
+JSON_KEY(row)
+JSON_KEY(uid)
+JSON_KEY(white_id)
+JSON_KEY(winner)
+JSON_CONST(json_result_true, "result", "true")
+JSON_CONST(json_result_false, "result", "false")
+JSON_CONST(json_op_put_chess, "optype", "\"put_chess\"")
+JSON_CONST(json_op_chat, "optype", "\"chat\"")
+JSON_CONST(json_op_room_ready, "optype", "\"room_ready\"")
+JSON_CONST(json_op_match_success, "optype", "\"match_success\"")
+
+/* 下棋成功的响应
+{"col":2,"optype":"put_chess","reason":"...","result":true,"room_id":222,"row":3,"uid":1,"winner":0}
+*/
+struct PutChessResp
+{
+    int col;
+    const char *reason;
+    uint64_t room_id;
+    int row;
+    uint64_t uid;
+    uint64_t winner;
+    typedef JsonSchema<PutChessResp,
+                       JSON_FIELD(PutChessResp, col),
+                       JsonConstField<json_op_put_chess>,
+                       JSON_FIELD(PutChessResp, reason),
+                       JsonConstField<json_result_true>,
+                       JSON_FIELD(PutChessResp, room_id),
+                       JSON_FIELD(PutChessResp, row),
+                       JSON_FIELD(PutChessResp, uid),
+                       JSON_FIELD(PutChessResp, winner)>
+        schema;
+};
+
+/* 聊天成功的响应
+{"message":"...","optype":"chat","result":true,"room_id":222,"uid":1}
+*/
+struct ChatResp
+{
+    std::string message;
+    uint64_t room_id;
+    uint64_t uid;
+    typedef JsonSchema<ChatResp,
+                       JSON_FIELD(ChatResp, message),
+                       JsonConstField<json_op_chat>,
+                       JsonConstField<json_result_true>,
+                       JSON_FIELD(ChatResp, room_id),
+                       JSON_FIELD(ChatResp, uid)>
+        schema;
+};
+
+/* 进入房间成功的响应
+{"black_id":2,"optype":"room_ready","result":true,"room_id":222,"uid":1,"white_id":1}
+*/
+struct RoomReadyResp
+{
+    uint64_t black_id;
+    uint64_t room_id;
+    uint64_t uid;
+    uint64_t white_id;
+    typedef JsonSchema<RoomReadyResp,
+                       JSON_FIELD(RoomReadyResp, black_id),
+                       JsonConstField<json_op_room_ready>,
+                       JsonConstField<json_result_true>,
+                       JSON_FIELD(RoomReadyResp, room_id),
+                       JSON_FIELD(RoomReadyResp, uid),
+                       JSON_FIELD(RoomReadyResp, white_id)>
+        schema;
+};
+
+/* 匹配成功的通知
+{"optype":"match_success","result":true,"room_id":222}
+*/
+struct MatchSuccessResp
+{
+    uint64_t room_id;
+    typedef JsonSchema<MatchSuccessResp,
+                       JsonConstField<json_op_match_success>,
+                       JsonConstField<json_result_true>,
+                       JSON_FIELD(MatchSuccessResp, room_id)>
+        schema;
+};
+
+/* 只有操作类型和结果的成功响应
+{"optype":"hall_ready","result":true}
+*/
+struct OkResp
+{
+    const char *optype;
+    typedef JsonSchema<OkResp,
+                       JSON_FIELD(OkResp, optype),
+                       JsonConstField<json_result_true>>
+        schema;
+};
+
+/* 失败的响应
+{"optype":"put_chess","reason":"...","result":false}
+*/
+struct FailResp
+{
+    const char *optype;
+    const char *reason;
+    typedef JsonSchema<FailResp,
+                       JSON_FIELD(FailResp, optype),
+                       JSON_FIELD(FailResp, reason),
+                       JsonConstField<json_result_false>>
+        schema;
+};
+
+/* 房间内请求失败的响应
+{"optype":"...","reason":"...","result":false,"room_id":222}
+*/
+struct RoomFailResp
+{
+    const char *optype;
+    const char *reason;
+    uint64_t room_id;
+    typedef JsonSchema<RoomFailResp,
+                       JSON_FIELD(RoomFailResp, optype),
+                       JSON_FIELD(RoomFailResp, reason),
+                       JsonConstField<json_result_false>,
+                       JSON_FIELD(RoomFailResp, room_id)>
+        schema;
+};
+
+/* 只有结果和原因的响应（http接口等）
+{"reason":"...","result":true}
+*/
+struct ResultResp
+{
+    const char *reason;
+    bool result;
+    typedef JsonSchema<ResultResp,
+                       JSON_FIELD(ResultResp, reason),
+                       JSON_FIELD(ResultResp, result)>
+        schema;
+};
+
+// 内容完全固定的响应只在第一次使用时编码一次，之后直接复用
+#define CONST_MSG(name, ...)                                        \
+    static const std::string &name()                                \
+    {                                                               \
+        static const std::string body = json_encode(__VA_ARGS__);   \
+        return body;                                                \
+    }
+
+class ConstMsg
+{
+public:
+    CONST_MSG(hall_ready, OkResp{"hall_ready"})
+    CONST_MSG(match_start, OkResp{"match_start"})
+    CONST_MSG(match_stop, OkResp{"match_stop"})
+    CONST_MSG(no_cookie, FailResp{"hall_ready", "找不到cookie信息，请重新登录"})
+    CONST_MSG(no_ssid, FailResp{"hall_ready", "找不到ssid信息，请重新登录"})
+    CONST_MSG(session_expired, FailResp{"hall_ready", "登录过期，请重新登录"})
+    CONST_MSG(hall_relogin, FailResp{"hall_ready", "玩家重复登录"})
+    CONST_MSG(room_relogin, FailResp{"room_ready", "玩家重复登录"})
+    CONST_MSG(room_not_found, FailResp{"room_ready", "没有找到玩家的房间信息"})
+    CONST_MSG(hall_bad_request, ResultResp{"请求信息解析失败", false})
+    CONST_MSG(room_bad_request, FailResp{"unknow", "请求解析失败"})
+    CONST_MSG(unknown_optype, FailResp{"unknow", "未知响应类型"})
+    CONST_MSG(unauthorized, FailResp{"unknow", "登录验证失败，请重新登录"})
+    CONST_MSG(room_mismatch, ResultResp{"房间号不匹配!", false})
+    CONST_MSG(match_limited, FailResp{"match_limited", "匹配请求过于频繁，请稍后再试"})
+    CONST_MSG(chat_limited, FailResp{"chat", "发言过于频繁，请稍后再试"})
+    CONST_MSG(http_limited, ResultResp{"请求过于频繁，请稍后再试", false})
+};
@@ -5,73 +5,118 @@
 
 #include "util.hpp"
 
+#define PRESENCE_SHARDS 64 // 在线状态表的分片数
+
+typedef enum
+{
+    PRESENCE_OFFLINE,  // 不在线(表中没有记录)
+    PRESENCE_HALL,     // 在游戏大厅
+    PRESENCE_MATCHING, // 在游戏大厅，并且正在匹配
+    PRESENCE_ROOM      // 在游戏房间
+} Presence_t;
+
+/**
+ * 在线用户管理：每个用户一条记录(状态 + 长连接)，按uid分片，每个分片一把锁
+ *   - 查询在线状态只查找一个分片，大厅和房间不再是两张表，不需要连续加锁两次
+ *   - 状态变化都是比较并设置：只有当前状态符合预期时才修改，检查和修改在同一次加锁中完成，
+ *     比如"不在线时才进入大厅"，同一个用户同时打开两个页面时只有一个能成功
+ */
 class OnlineManager
 {
 public:
-    void enter_game_hall(uint64_t uid, wsserver_t::connection_ptr &conn)
+    // 不在线时进入游戏大厅，已经在大厅或者房间中返回false
+    bool enter_game_hall(uint64_t uid, wsserver_t::connection_ptr &conn)
     {
-        std::lock_guard<std::mutex> lck(_mutex); // 加锁，保证线程安全
-        _game_hall.insert(make_pair(uid, conn));
+        return enter(uid, PRESENCE_HALL, conn);
     }
-    void enter_game_room(uint64_t uid, wsserver_t::connection_ptr &conn)
+    // 不在线时进入游戏房间，已经在大厅或者房间中返回false
+    bool enter_game_room(uint64_t uid, wsserver_t::connection_ptr &conn)
     {
-        std::lock_guard<std::mutex> lck(_mutex);
-        _game_room.insert(make_pair(uid, conn));
+        return enter(uid, PRESENCE_ROOM, conn);
     }
+    // 退出游戏大厅(包括正在匹配的)，变为不在线
     void exit_game_hall(uint64_t uid)
     {
-        std::lock_guard<std::mutex> lck(_mutex);
-        _game_hall.erase(uid);
+        leave(uid, PRESENCE_HALL, PRESENCE_MATCHING);
     }
+    // 退出游戏房间，变为不在线
     void exit_game_room(uint64_t uid)
     {
-        std::lock_guard<std::mutex> lck(_mutex);
-        _game_room.erase(uid);
+        leave(uid, PRESENCE_ROOM, PRESENCE_ROOM);
     }
-    bool in_game_hall(uint64_t uid)
+    // 当前状态是from时改为to，返回是否修改成功；不能用于进入或者离开(OFFLINE)
+    bool transition(uint64_t uid, Presence_t from, Presence_t to)
     {
-        std::lock_guard<std::mutex> lck(_mutex); // 这里考虑是不是可以不加锁，只有读取，没有写入！！！！
-        auto pos = _game_hall.find(uid);
-        if (pos == _game_hall.end())
-        {
+        Shard &shard = shard_of(uid);
+        std::lock_guard<std::mutex> lck(shard.mutex);
+        auto it = shard.users.find(uid);
+        if (it == shard.users.end() || it->second.state != from)
             return false;
-        }
+        it->second.state = to;
         return true;
     }
-    bool in_game_room(uint64_t uid)
+    Presence_t state(uint64_t uid)
     {
-        std::lock_guard<std::mutex> lck(_mutex);
-        auto pos = _game_room.find(uid);
-        if (pos == _game_room.end())
-        {
-            return false;
-        }
-        return true;
+        Shard &shard = shard_of(uid);
+        std::lock_guard<std::mutex> lck(shard.mutex);
+        auto it = shard.users.find(uid);
+        return it == shard.users.end() ? PRESENCE_OFFLINE : it->second.state;
     }
+    bool online(uint64_t uid) { return state(uid) != PRESENCE_OFFLINE; }
+    bool in_game_hall(uint64_t uid)
+    {
+        Presence_t s = state(uid);
+        return s == PRESENCE_HALL || s == PRESENCE_MATCHING;
+    }
+    bool in_game_room(uint64_t uid) { return state(uid) == PRESENCE_ROOM; }
     // 这里如果没找到对应uid的用户就返回nullptr，所以使用前需要检测
     wsserver_t::connection_ptr get_conn_from_hall(uint64_t uid)
     {
-        std::lock_guard<std::mutex> lck(_mutex);
-        auto pos = _game_hall.find(uid);
-        if (pos == _game_hall.end())
-        {
-            return wsserver_t::connection_ptr();
-        }
-        return pos->second;
+        return get_conn(uid, PRESENCE_HALL, PRESENCE_MATCHING);
     }
     wsserver_t::connection_ptr get_conn_from_room(uint64_t uid)
     {
-        std::lock_guard<std::mutex> lck(_mutex);
-        auto pos = _game_room.find(uid);
-        if (pos == _game_room.end())
-        {
+        return get_conn(uid, PRESENCE_ROOM, PRESENCE_ROOM);
+    }
+
+private:
+    struct Presence
+    {
+        Presence_t state;
+        wsserver_t::connection_ptr conn;
+    };
+    struct Shard
+    {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, Presence> users; // 不在线的用户没有记录
+    };
+    Shard &shard_of(uint64_t uid) { return _shards[uid % PRESENCE_SHARDS]; }
+    bool enter(uint64_t uid, Presence_t state, wsserver_t::connection_ptr &conn)
+    {
+        Shard &shard = shard_of(uid);
+        std::lock_guard<std::mutex> lck(shard.mutex);
+        Presence p = {state, conn};
+        return shard.users.insert(std::make_pair(uid, p)).second;
+    }
+    // 当前状态是s1或s2时删除记录
+    void leave(uint64_t uid, Presence_t s1, Presence_t s2)
+    {
+        Shard &shard = shard_of(uid);
+        std::lock_guard<std::mutex> lck(shard.mutex);
+        auto it = shard.users.find(uid);
+        if (it != shard.users.end() && (it->second.state == s1 || it->second.state == s2))
+            shard.users.erase(it);
+    }
+    wsserver_t::connection_ptr get_conn(uint64_t uid, Presence_t s1, Presence_t s2)
+    {
+        Shard &shard = shard_of(uid);
+        std::lock_guard<std::mutex> lck(shard.mutex);
+        auto it = shard.users.find(uid);
+        if (it == shard.users.end() || (it->second.state != s1 && it->second.state != s2))
             return wsserver_t::connection_ptr();
-        }
-        return pos->second;
+        return it->second.conn;
     }
 
 private:
-    std::mutex _mutex;                                                   // 互斥锁保证线程安全
-    std::unordered_map<uint64_t, wsserver_t::connection_ptr> _game_hall; // 游戏大厅用户管理
-    std::unordered_map<uint64_t, wsserver_t::connection_ptr> _game_room; // 游戏房间用户管理
+    Shard _shards[PRESENCE_SHARDS];
 };
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <atomic>
+#include <cstring>
+
+#include "util.hpp"
+
+#define OUTBOUND_SOFT_BYTES (64 * 1024)   // 发送缓冲超过该值时，对非关键消息执行溢出策略
+#define OUTBOUND_HARD_BYTES (1024 * 1024) // 发送缓冲超过该值时，关闭连接
+#define OUTBOUND_MAX_MESSAGES 1024        // 积压的消息条数超过该值时，关闭连接
+
+typedef enum
+{
+    MSG_CRITICAL, // 关键消息(响应、下棋结果、匹配成功)，在硬上限之内总是发送
+    MSG_NORMAL    // 非关键消息(聊天)，发送缓冲超过软上限时按溢出策略处理
+} MsgPriority_t;
+
+typedef enum
+{
+    OVERFLOW_DROP,     // 丢弃非关键消息
+    OVERFLOW_COALESCE, // 只保留最新的一条非关键消息，等缓冲降下来后再发送
+    OVERFLOW_CLOSE     // 直接关闭连接
+} OverflowPolicy_t;
+
+struct OutboundConfig
+{
+    OutboundConfig()
+        : soft_bytes(OUTBOUND_SOFT_BYTES), hard_bytes(OUTBOUND_HARD_BYTES),
+          max_messages(OUTBOUND_MAX_MESSAGES), policy(OVERFLOW_DROP) {}
+    size_t soft_bytes;
+    size_t hard_bytes;
+    size_t max_messages;
+    OverflowPolicy_t policy;
+};
+
+/**
+ * 长连接的发送限流：所有主动推送给客户端的消息都经过这里
+ * 慢客户端(比如信号差的手机)的发送缓冲会无限增长，这里根据缓冲字节数和积压消息条数来限制：
+ * 超过软上限时按策略处理非关键消息，超过硬上限时用1008关闭连接，走正常的关闭流程清理房间和session
+ * 积压消息条数：websocketpp不提供发送队列长度，这里统计自发送缓冲上一次为空以来发出的消息数，是积压条数的上界
+ */
+class OutboundLimiter
+{
+public:
+    OutboundLimiter() : _dropped(0), _coalesced(0), _evicted(0), _logged{0, 0, 0} {}
+    // 在服务器启动前调用
+    void configure(const OutboundConfig &conf) { _conf = conf; }
+    // 发送一条消息，消息被丢弃/合并/连接被关闭时返回false
+    bool send(const wsserver_t::connection_ptr &conn, const std::string &body,
+              websocketpp::frame::opcode::value op = websocketpp::frame::opcode::text,
+              MsgPriority_t prio = MSG_CRITICAL)
+    {
+        OutboundState &st = conn->outbound();
+        std::lock_guard<std::mutex> lck(st.mutex);
+        if (st.evicted)
+            return false;
+        size_t buffered = conn->get_buffered_amount();
+        if (buffered == 0)
+            st.queued = 0;
+        // 1. 超过硬上限：关闭连接
+        if (buffered >= _conf.hard_bytes || st.queued >= _conf.max_messages)
+        {
+            evict(conn, st, buffered);
+            return false;
+        }
+        // 2. 超过软上限：非关键消息按策略处理
+        if (buffered >= _conf.soft_bytes && prio == MSG_NORMAL)
+        {
+            if (_conf.policy == OVERFLOW_CLOSE)
+            {
+                evict(conn, st, buffered);
+            }
+            else if (_conf.policy == OVERFLOW_COALESCE)
+            {
+                if (st.has_pending)
+                    ++_coalesced; // 之前合并的那一条被新的替换掉
+                st.pending = body;
+                st.pending_op = op;
+                st.has_pending = true;
+            }
+            else
+            {
+                ++_dropped;
+            }
+            return false;
+        }
+        // 3. 先发送之前合并保留的消息，保证顺序
+        if (st.has_pending && buffered < _conf.soft_bytes)
+        {
+            write(conn, st, st.pending, st.pending_op);
+            st.pending.clear();
+            st.has_pending = false;
+        }
+        write(conn, st, body, op);
+        return true;
+    }
+    // 发送缓冲降下来之后，把合并保留的消息发出去（由定时任务调用）
+    void flush(const wsserver_t::connection_ptr &conn)
+    {
+        OutboundState &st = conn->outbound();
+        std::lock_guard<std::mutex> lck(st.mutex);
+        if (st.evicted || st.has_pending == false || conn->get_buffered_amount() >= _conf.soft_bytes)
+            return;
+        write(conn, st, st.pending, st.pending_op);
+        st.pending.clear();
+        st.has_pending = false;
+    }
+    uint64_t dropped() { return _dropped; }
+    uint64_t coalesced() { return _coalesced; }
+    uint64_t evicted() { return _evicted; }
+    // 和上一次相比有变化时输出累计的统计（由服务器的统计定时任务调用）
+    void log_stats()
+    {
+        uint64_t now[3] = {dropped(), coalesced(), evicted()};
+        if (memcmp(now, _logged, sizeof(now)) == 0)
+            return;
+        memcpy(_logged, now, sizeof(now));
+        INF_LOG("长连接发送限流: 丢弃 %lu 条, 合并 %lu 条, 因积压关闭 %lu 个连接",
+                (unsigned long)now[0], (unsigned long)now[1], (unsigned long)now[2]);
+    }
+
+private:
+    void write(const wsserver_t::connection_ptr &conn, OutboundState &st, const std::string &body,
+               websocketpp::frame::opcode::value op)
+    {
+        websocketpp::lib::error_code ec = conn->send(body, op);
+        if (!ec)
+            ++st.queued;
+    }
+    void evict(const wsserver_t::connection_ptr &conn, OutboundState &st, size_t buffered)
+    {
+        st.evicted = true;
+        st.pending.clear();
+        st.has_pending = false;
+        ++_evicted;
+        DBG_LOG("连接发送缓冲积压过多(%lu 字节, %lu 条)，关闭连接", (unsigned long)buffered, (unsigned long)st.queued);
+        websocketpp::lib::error_code ec;
+        conn->close(websocketpp::close::status::policy_violation, "send buffer overflow", ec);
+    }
+
+private:
+    OutboundConfig _conf;
+    std::atomic<uint64_t> _dropped;   // 被丢弃的非关键消息数
+    std::atomic<uint64_t> _coalesced; // 被合并(替换)掉的非关键消息数
+    std::atomic<uint64_t> _evicted;   // 因为积压被关闭的连接数
+    uint64_t _logged[3];              // 上一次输出的统计，只在统计定时任务中访问
+};
@@ -0,0 +1,452 @@
+#pragma once
+
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <mysql/errmsg.h>
+
+#include "util.hpp"
+
+#define MYSQL_POOL_SIZE 8          // 连接池最多的连接数
+#define MYSQL_POOL_TIMEOUT 3000    // 获取连接时最长的等待时间(ms)
+#define MYSQL_POOL_PING_IDLE 30000 // 空闲超过该时间的连接在取出时先ping一次，检查是否已被服务器断开(ms)
+#define MYSQL_MAX_BINDS 8          // 一条预处理语句默认最多绑定的参数/结果个数
+
+// 池中的一个连接
+struct MysqlConn
+{
+    MysqlConn() : mysql(nullptr), last_used(0) {}
+    MYSQL *mysql;      // 为nullptr表示还没有连接或者已经断开，取出时重新连接
+    int64_t last_used; // 上一次归还的时间(ms)
+    std::vector<std::pair<const char *, MYSQL_STMT *>> stmts; // 在这个连接上预处理过的语句，连接断开时一起关闭
+};
+
+// 预处理语句的参数/结果绑定，绑定的变量在语句执行(取结果)期间要一直有效
+// 多行insert这种参数较多的语句构造时传入需要的个数
+class MysqlBinds
+{
+public:
+    MysqlBinds(size_t cap = MYSQL_MAX_BINDS) : _n(0), _binds(cap), _lens(cap) {} // vector中的MYSQL_BIND都是零初始化的
+    MysqlBinds &add(int *v)
+    {
+        MYSQL_BIND &b = next();
+        b.buffer_type = MYSQL_TYPE_LONG;
+        b.buffer = v;
+        return *this;
+    }
+    MysqlBinds &add(uint64_t *v)
+    {
+        MYSQL_BIND &b = next();
+        b.buffer_type = MYSQL_TYPE_LONGLONG;
+        b.buffer = v;
+        b.is_unsigned = true;
+        return *this;
+    }
+    MysqlBinds &add(int64_t *v)
+    {
+        MYSQL_BIND &b = next();
+        b.buffer_type = MYSQL_TYPE_LONGLONG;
+        b.buffer = v;
+        return *this;
+    }
+    // 字符串参数，二进制数据使用MYSQL_TYPE_BLOB
+    MysqlBinds &add(const std::string &s, enum_field_types type = MYSQL_TYPE_STRING)
+    {
+        _lens[_n] = s.size();
+        MYSQL_BIND &b = next();
+        b.buffer_type = type;
+        b.buffer = (void *)s.data();
+        b.buffer_length = s.size();
+        b.length = &_lens[_n - 1];
+        return *this;
+    }
+    // 字符串结果：最多写入cap个字节，实际长度写入len
+    MysqlBinds &add(char *buf, size_t cap, unsigned long *len)
+    {
+        MYSQL_BIND &b = next();
+        b.buffer_type = MYSQL_TYPE_STRING;
+        b.buffer = buf;
+        b.buffer_length = cap;
+        b.length = len;
+        return *this;
+    }
+    MYSQL_BIND *get() { return _binds.data(); }
+
+private:
+    MYSQL_BIND &next()
+    {
+        assert(_n < _binds.size());
+        return _binds[_n++];
+    }
+
+private:
+    size_t _n;
+    std::vector<MYSQL_BIND> _binds; // 构造后不再扩容，_lens中的地址一直有效
+    std::vector<unsigned long> _lens;
+};
+
+// 连接池的统计信息
+struct MysqlPoolStats
+{
+    size_t size;          // 已经创建的连接数
+    size_t in_use;        // 正在使用的连接数
+    uint64_t acquired;    // 成功取出连接的次数
+    uint64_t timeouts;    // 等待超时的次数
+    uint64_t errors;      // 连接或执行出错的次数
+    uint64_t reconnects;  // 重新连接的次数
+    double avg_wait_us;   // 取出连接的平均等待时间(us)
+    int64_t max_wait_us;  // 取出连接的最长等待时间(us)
+};
+
+/**
+ * mysql连接池：多个事件循环线程的数据库操作不再串行在一个连接上
+ *   - 连接按需创建，最多MYSQL_POOL_SIZE个；没有空闲连接时最多等待MYSQL_POOL_TIMEOUT，超时返回空的连接
+ *   - 空闲连接按后进先出复用，空闲较久的连接取出时先ping，服务器重启或者wait_timeout断开的连接在这里重新连接
+ *   - 执行时发现连接已断开(CR_SERVER_GONE_ERROR，语句还没有发送到服务器)就重连后重试一次
+ *     CR_SERVER_LOST时语句可能已经执行，不重试，只把连接标记为断开，下次取出时重连
+ */
+class MysqlPool
+{
+public:
+    // 取出的连接，析构时自动归还
+    class Guard
+    {
+    public:
+        Guard() : _pool(nullptr), _conn(nullptr), _broken(false), _in_txn(false) {}
+        Guard(MysqlPool *pool, MysqlConn *conn) : _pool(pool), _conn(conn), _broken(false), _in_txn(false) {}
+        Guard(Guard &&other) : _pool(other._pool), _conn(other._conn), _broken(other._broken), _in_txn(other._in_txn)
+        {
+            other._pool = nullptr;
+            other._conn = nullptr;
+        }
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+        ~Guard() { release(); }
+        explicit operator bool() const { return _conn != nullptr; }
+        MYSQL *get() { return _conn->mysql; }
+        // 执行预处理语句：语句在每个连接上只预处理一次，之后每次只发送参数
+        // 连接断开时重连、重新预处理并重试一次，失败返回nullptr
+        MYSQL_STMT *execute(const char *sql, MYSQL_BIND *params)
+        {
+            unsigned int err = 0;
+            MYSQL_STMT *stmt = _pool->execute(_conn, sql, params, err);
+            // 事务中不能重连重试：新连接上没有事务，后面的语句会被自动提交
+            if (stmt == nullptr && err == CR_SERVER_GONE_ERROR && !_in_txn && _pool->reconnect(_conn))
+                stmt = _pool->execute(_conn, sql, params, err);
+            if (stmt == nullptr)
+                failed(err);
+            return stmt;
+        }
+        // 取出execute的结果集，第一行写入result绑定的变量，返回结果的行数，出错返回-1
+        int fetch_one(MYSQL_STMT *stmt, MYSQL_BIND *result)
+        {
+            int rows = -1;
+            if (!mysql_stmt_bind_result(stmt, result) && mysql_stmt_store_result(stmt) == 0)
+            {
+                rows = (int)mysql_stmt_num_rows(stmt);
+                if (rows > 0)
+                {
+                    int ret = mysql_stmt_fetch(stmt);
+                    if (ret != 0 && ret != MYSQL_DATA_TRUNCATED)
+                        rows = -1;
+                }
+            }
+            if (rows < 0)
+            {
+                ERR_LOG("获取预处理语句结果出错: %s", mysql_stmt_error(stmt));
+                failed(mysql_stmt_errno(stmt));
+            }
+            mysql_stmt_free_result(stmt);
+            return rows;
+        }
+        // 逐行读取结果(不在客户端缓存整个结果集)，每一行调用一次cb，返回行数，出错返回-1
+        template <class Callback>
+        int fetch_each(MYSQL_STMT *stmt, MYSQL_BIND *result, const Callback &cb)
+        {
+            int rows = 0, ret = 0;
+            if (mysql_stmt_bind_result(stmt, result))
+                rows = -1;
+            while (rows >= 0 && (ret = mysql_stmt_fetch(stmt)) != MYSQL_NO_DATA)
+            {
+                if (ret != 0 && ret != MYSQL_DATA_TRUNCATED)
+                {
+                    rows = -1;
+                    break;
+                }
+                cb();
+                ++rows;
+            }
+            if (rows < 0)
+            {
+                ERR_LOG("获取预处理语句结果出错: %s", mysql_stmt_error(stmt));
+                failed(mysql_stmt_errno(stmt));
+            }
+            mysql_stmt_free_result(stmt);
+            return rows;
+        }
+        // 开启事务：之后的语句直到commit/rollback都在同一个事务中
+        bool begin()
+        {
+            if (mysql_autocommit(_conn->mysql, false))
+            {
+                ERR_LOG("开启事务出错: %s", mysql_error(_conn->mysql));
+                failed();
+                return false;
+            }
+            _in_txn = true;
+            return true;
+        }
+        bool commit()
+        {
+            if (mysql_commit(_conn->mysql))
+            {
+                ERR_LOG("提交事务出错: %s", mysql_error(_conn->mysql));
+                failed();
+                rollback();
+                return false;
+            }
+            end_txn();
+            return true;
+        }
+        void rollback()
+        {
+            mysql_rollback(_conn->mysql);
+            end_txn();
+        }
+        // 操作出错：连接断开的话归还时关闭，下次取出时重新连接
+        void failed() { failed(mysql_errno(_conn->mysql)); }
+        void failed(unsigned int err)
+        {
+            ++_pool->_errors;
+            if (err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST)
+                _broken = true;
+        }
+        void release()
+        {
+            if (_conn == nullptr)
+                return;
+            if (_in_txn)
+                rollback(); // 没有提交的事务不能留给下一个使用者
+            _pool->put_back(_conn, _broken);
+            _conn = nullptr;
+        }
+
+    private:
+        void end_txn()
+        {
+            _in_txn = false;
+            if (mysql_autocommit(_conn->mysql, true))
+                _broken = true; // 恢复不了自动提交的连接不再复用
+        }
+
+    private:
+        MysqlPool *_pool;
+        MysqlConn *_conn;
+        bool _broken;
+        bool _in_txn; // 是否在事务中
+    };
+
+public:
+    MysqlPool(const std::string &host, const std::string &user, const std::string &password,
+              const std::string &db, uint16_t port, size_t size = MYSQL_POOL_SIZE, int timeout_ms = MYSQL_POOL_TIMEOUT)
+        : _host(host), _user(user), _password(password), _db(db), _port(port), _size(size < 1 ? 1 : size),
+          _timeout_ms(timeout_ms), _in_use(0), _acquired(0), _timeouts(0), _errors(0), _reconnects(0),
+          _wait_us(0), _max_wait_us(0), _logged{0, 0, 0, 0}
+    {
+        // 先建立一个连接，连接参数有误时在启动阶段就能发现
+        _conns.emplace_back(new MysqlConn());
+        connect(_conns.back().get());
+        _conns.back()->last_used = now_ms();
+        _idle.push_back(_conns.back().get());
+        DBG_LOG("mysql连接池初始化，最多 %lu 个连接", (unsigned long)_size);
+    }
+    ~MysqlPool()
+    {
+        for (auto &c : _conns)
+            close(c.get());
+    }
+    // 第一个连接是否连接成功
+    bool ready() { return _conns.front()->mysql != nullptr; }
+    // 取出一个可用的连接，超时或者连接失败时返回空的Guard
+    Guard acquire()
+    {
+        auto start = std::chrono::steady_clock::now();
+        MysqlConn *conn = nullptr;
+        {
+            std::unique_lock<std::mutex> lck(_mutex);
+            bool ok = _cond.wait_for(lck, std::chrono::milliseconds(_timeout_ms),
+                                     [this]() { return !_idle.empty() || _conns.size() < _size; });
+            if (ok == false)
+            {
+                ++_timeouts;
+                ERR_LOG("获取mysql连接超时，%lu 个连接都在使用中", (unsigned long)_in_use);
+                return Guard();
+            }
+            if (!_idle.empty())
+            {
+                conn = _idle.back();
+                _idle.pop_back();
+            }
+            else
+            {
+                _conns.emplace_back(new MysqlConn());
+                conn = _conns.back().get();
+            }
+            ++_in_use;
+        }
+        int64_t wait = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        _wait_us += wait;
+        int64_t max = _max_wait_us;
+        while (wait > max && !_max_wait_us.compare_exchange_weak(max, wait))
+            ;
+        // 新建连接和健康检查都在锁外进行，不阻塞其他线程取连接
+        bool ok = true;
+        if (conn->last_used == 0)
+            ok = connect(conn); // 新加入池的连接
+        else if (conn->mysql == nullptr || (now_ms() - conn->last_used > MYSQL_POOL_PING_IDLE && mysql_ping(conn->mysql) != 0))
+            ok = reconnect(conn);
+        if (ok == false)
+        {
+            ++_errors;
+            put_back(conn, true);
+            return Guard();
+        }
+        ++_acquired;
+        return Guard(this, conn);
+    }
+    MysqlPoolStats stats()
+    {
+        MysqlPoolStats st;
+        {
+            std::lock_guard<std::mutex> lck(_mutex);
+            st.size = _conns.size();
+            st.in_use = _in_use;
+        }
+        st.acquired = _acquired;
+        st.timeouts = _timeouts;
+        st.errors = _errors;
+        st.reconnects = _reconnects;
+        st.avg_wait_us = st.acquired == 0 ? 0 : (double)_wait_us / st.acquired;
+        st.max_wait_us = _max_wait_us;
+        return st;
+    }
+    // 和上一次相比有变化时输出统计信息（由服务器的统计定时任务调用）
+    void log_stats()
+    {
+        MysqlPoolStats st = stats();
+        uint64_t now[4] = {st.acquired, st.timeouts, st.errors, st.reconnects};
+        if (memcmp(now, _logged, sizeof(now)) == 0)
+            return;
+        memcpy(_logged, now, sizeof(now));
+        INF_LOG("mysql连接池: 连接 %lu 个, 使用中 %lu 个, 取出 %lu 次, 平均等待 %.1f us, 最长等待 %ld us, "
+                "超时 %lu 次, 出错 %lu 次, 重连 %lu 次",
+                (unsigned long)st.size, (unsigned long)st.in_use, (unsigned long)st.acquired, st.avg_wait_us,
+                (long)st.max_wait_us, (unsigned long)st.timeouts, (unsigned long)st.errors, (unsigned long)st.reconnects);
+    }
+
+private:
+    bool connect(MysqlConn *conn)
+    {
+        conn->mysql = MysqlUtil::mysql_create(_host, _user, _password, _db, _port);
+        return conn->mysql != nullptr;
+    }
+    // 关闭原来的连接并重新连接（只由持有该连接的线程调用）
+    bool reconnect(MysqlConn *conn)
+    {
+        close(conn);
+        ++_reconnects;
+        if (connect(conn) == false)
+            return false;
+        INF_LOG("mysql连接已重新建立");
+        return true;
+    }
+    void put_back(MysqlConn *conn, bool broken)
+    {
+        if (broken)
+            close(conn);
+        conn->last_used = now_ms();
+        {
+            std::lock_guard<std::mutex> lck(_mutex);
+            _idle.push_back(conn);
+            --_in_use;
+        }
+        _cond.notify_one();
+    }
+    // 关闭连接和在它上面预处理过的语句
+    void close(MysqlConn *conn)
+    {
+        for (auto &it : conn->stmts)
+            mysql_stmt_close(it.second);
+        conn->stmts.clear();
+        MysqlUtil::mysql_destory(conn->mysql);
+        conn->mysql = nullptr;
+    }
+    // 找到(或者预处理)sql对应的语句，绑定参数并执行
+    MYSQL_STMT *execute(MysqlConn *conn, const char *sql, MYSQL_BIND *params, unsigned int &err)
+    {
+        MYSQL_STMT *stmt = nullptr;
+        for (auto &it : conn->stmts)
+        {
+            if (it.first == sql || strcmp(it.first, sql) == 0)
+            {
+                stmt = it.second;
+                break;
+            }
+        }
+        if (stmt == nullptr)
+        {
+            stmt = mysql_stmt_init(conn->mysql);
+            if (stmt == nullptr)
+            {
+                err = mysql_errno(conn->mysql);
+                return nullptr;
+            }
+            if (mysql_stmt_prepare(stmt, sql, strlen(sql)) != 0)
+            {
+                err = mysql_stmt_errno(stmt);
+                ERR_LOG("sql语句: %s 预处理出错, %s", sql, mysql_stmt_error(stmt));
+                mysql_stmt_close(stmt);
+                return nullptr;
+            }
+            conn->stmts.push_back(std::make_pair(sql, stmt));
+        }
+        if ((params != nullptr && mysql_stmt_bind_param(stmt, params)) || mysql_stmt_execute(stmt) != 0)
+        {
+            err = mysql_stmt_errno(stmt);
+            ERR_LOG("sql语句: %s 执行出错, %s", sql, mysql_stmt_error(stmt));
+            return nullptr;
+        }
+        return stmt;
+    }
+    static int64_t now_ms()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+private:
+    std::string _host;
+    std::string _user;
+    std::string _password;
+    std::string _db;
+    uint16_t _port;
+    size_t _size;
+    int _timeout_ms;
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::vector<std::unique_ptr<MysqlConn>> _conns; // 已经创建的所有连接
+    std::vector<MysqlConn *> _idle;                 // 空闲的连接，后进先出
+    size_t _in_use;
+    std::atomic<uint64_t> _acquired;
+    std::atomic<uint64_t> _timeouts;
+    std::atomic<uint64_t> _errors;
+    std::atomic<uint64_t> _reconnects;
+    std::atomic<int64_t> _wait_us;     // 累计的等待时间
+    std::atomic<int64_t> _max_wait_us;
+    uint64_t _logged[4]; // 上一次输出的统计，只在统计定时任务中访问
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+/**
+ * 游戏房间的二进制帧协议
+ * 客户端在websocket握手时通过 Sec-WebSocket-Protocol 请求 BINARY_SUBPROTOCOL，服务器同意之后，
+ * 该连接上的下棋请求和下棋结果使用定长的二进制帧，其他消息(聊天、room_ready等)仍然使用JSON文本帧
+ * 没有请求该子协议的老客户端继续使用JSON
+ *
+ * 下棋请求 (客户端->服务器，3字节)：
+ *   [0] BIN_OP_PUT_CHESS  [1] 行号  [2] 列号
+ *   房间号和用户id由连接上下文确定，不需要携带
+ * 下棋结果 (服务器->客户端，6字节)：
+ *   [0] BIN_OP_CHESS_RESULT  [1] ChessCode_t  [2] 行号  [3] 列号  [4] 落子方颜色  [5] 胜利方颜色
+ *   行号/列号为0xFF表示没有落子(如对方掉线)，颜色：0-无 1-黑 2-白，黑白双方的uid在room_ready中给出
+ */
+
+#define BINARY_SUBPROTOCOL "gobang.bin"
+
+#define BIN_OP_PUT_CHESS 0x01
+#define BIN_MOVE_SIZE 3
+
+#define BIN_OP_CHESS_RESULT 0x81
+#define BIN_CHESS_RESULT_SIZE 6
+
+#define BIN_NO_POS 0xFF
+
+// 下棋结果码：成功的结果排在前面，CHESS_OCCUPIED及之后都是失败
+typedef enum
+{
+    CHESS_CONTINUE = 0,         // 游戏继续
+    CHESS_WIN = 1,              // 落子方胜利
+    CHESS_OPPONENT_EXIT = 2,    // 对方已经退出房间，落子方胜利
+    CHESS_OPPONENT_OFFLINE = 3, // 对方掉线，不战而胜
+    CHESS_OCCUPIED = 4,         // 当前位置已经有棋子
+    CHESS_OUT_OF_RANGE = 5      // 走棋位置超出棋盘范围
+} ChessCode_t;
+
+class BinaryProto
+{
+public:
+    // 解析下棋请求帧，格式不对返回false
+    static bool decode_move(const std::string &payload, int &row, int &col)
+    {
+        if (payload.size() != BIN_MOVE_SIZE || (uint8_t)payload[0] != BIN_OP_PUT_CHESS)
+        {
+            return false;
+        }
+        row = (uint8_t)payload[1];
+        col = (uint8_t)payload[2];
+        return true;
+    }
+    // 编码下棋结果帧，row/col小于0时编码为BIN_NO_POS
+    static void encode_chess(std::string &out, ChessCode_t code, int row, int col, int mover_color, int winner_color)
+    {
+        out.resize(BIN_CHESS_RESULT_SIZE);
+        out[0] = (char)BIN_OP_CHESS_RESULT;
+        out[1] = (char)code;
+        out[2] = (char)(row < 0 ? BIN_NO_POS : row);
+        out[3] = (char)(col < 0 ? BIN_NO_POS : col);
+        out[4] = (char)mover_color;
+        out[5] = (char)winner_color;
+    }
+};
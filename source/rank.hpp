@@ -0,0 +1,371 @@
+#pragma once
+
+#include <map>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "message.hpp"
+#include "util.hpp"
+
+#define RANK_DEFAULT_LIMIT 20 // 排行榜每页默认的条数
+#define RANK_MAX_LIMIT 100    // 排行榜每页最多的条数
+#define RANK_CACHE_TOP 100    // 落在前RANK_CACHE_TOP名之内的页面缓存编码好的响应
+#define RANK_CACHE_PAGES 64   // 最多缓存的页面数
+
+JSON_KEY(offset)
+JSON_KEY(rank)
+JSON_KEY(socre)
+JSON_KEY(total)
+JSON_KEY(username)
+
+/* 排行榜中的一项
+{"rank":1,"socre":1300,"uid":5,"username":"..."}
+*/
+struct RankEntry
+{
+    uint64_t rank;
+    int socre;
+    uint64_t uid;
+    std::string username;
+    typedef JsonSchema<RankEntry,
+                       JSON_FIELD(RankEntry, rank),
+                       JSON_FIELD(RankEntry, socre),
+                       JSON_FIELD(RankEntry, uid),
+                       JSON_FIELD(RankEntry, username)>
+        schema;
+};
+
+/* 排行榜的一页
+{"list":[...],"offset":0,"result":true,"total":1234}
+*/
+struct RankPage
+{
+    std::vector<RankEntry> list;
+    uint64_t offset;
+    uint64_t total;
+    typedef JsonSchema<RankPage,
+                       JSON_FIELD(RankPage, list),
+                       JSON_FIELD(RankPage, offset),
+                       JsonConstField<json_result_true>,
+                       JSON_FIELD(RankPage, total)>
+        schema;
+};
+
+/**
+ * 按积分排名的内存索引：积分从高到低，积分相同时uid小的在前
+ * 使用带子树大小的treap(顺序统计树)，插入/删除/查询某个用户的名次/按名次取第k个都是O(log n)，取一页是O(log n + limit)
+ * 启动时从数据库加载全部用户，之后积分变化时增量更新
+ */
+class RankIndex
+{
+public:
+    RankIndex() : _root(nullptr), _rand(20240601) {}
+    ~RankIndex() { destroy(_root); }
+    // 加入或更新用户
+    void set(uint64_t uid, const std::string &username, int socre)
+    {
+        auto it = _users.find(uid);
+        if (it != _users.end())
+        {
+            erase(_root, Key{it->second.socre, uid});
+            it->second.socre = socre;
+            if (!username.empty())
+                it->second.username = username;
+        }
+        else
+        {
+            User u = {username, socre};
+            _users.insert(std::make_pair(uid, u));
+        }
+        insert(_root, new Node(Key{socre, uid}, _rand()));
+    }
+    // 积分变化，用户不存在时返回false
+    bool add(uint64_t uid, int delta)
+    {
+        auto it = _users.find(uid);
+        if (it == _users.end())
+            return false;
+        set(uid, std::string(), it->second.socre + delta);
+        return true;
+    }
+    // 用户当前的积分，用户不存在时返回false
+    bool socre(uint64_t uid, int &socre)
+    {
+        auto it = _users.find(uid);
+        if (it == _users.end())
+            return false;
+        socre = it->second.socre;
+        return true;
+    }
+    // 用户的名次（从0开始），用户不存在时返回false
+    bool rank(uint64_t uid, uint64_t &rank)
+    {
+        auto it = _users.find(uid);
+        if (it == _users.end())
+            return false;
+        Key key = {it->second.socre, uid};
+        rank = 0;
+        for (Node *t = _root; t != nullptr;)
+        {
+            if (before(key, t->key))
+            {
+                t = t->left;
+            }
+            else
+            {
+                rank += size(t->left);
+                if (!before(t->key, key))
+                    break; // 就是当前节点
+                rank += 1;
+                t = t->right;
+            }
+        }
+        return true;
+    }
+    // 从第offset名开始取最多limit个
+    void range(uint64_t offset, size_t limit, std::vector<RankEntry> &out)
+    {
+        size_t skip = offset;
+        collect(_root, skip, limit, offset, out);
+    }
+    size_t size() { return size(_root); }
+
+private:
+    struct Key
+    {
+        int socre;
+        uint64_t uid;
+    };
+    struct Node
+    {
+        Node(const Key &k, uint32_t p) : key(k), prio(p), size(1), left(nullptr), right(nullptr) {}
+        Key key;
+        uint32_t prio; // 堆的优先级，随机生成
+        size_t size;   // 子树的节点数
+        Node *left;
+        Node *right;
+    };
+    struct User
+    {
+        std::string username;
+        int socre;
+    };
+    // a是否排在b前面
+    static bool before(const Key &a, const Key &b)
+    {
+        return a.socre > b.socre || (a.socre == b.socre && a.uid < b.uid);
+    }
+    static size_t size(Node *t) { return t == nullptr ? 0 : t->size; }
+    static void update(Node *t) { t->size = 1 + size(t->left) + size(t->right); }
+    // 按key把t分成排在key前面的l和其余的r
+    static void split(Node *t, const Key &key, Node *&l, Node *&r)
+    {
+        if (t == nullptr)
+        {
+            l = r = nullptr;
+            return;
+        }
+        if (before(t->key, key))
+        {
+            split(t->right, key, t->right, r);
+            l = t;
+        }
+        else
+        {
+            split(t->left, key, l, t->left);
+            r = t;
+        }
+        update(t);
+    }
+    // l中的节点都排在r前面
+    static Node *merge(Node *l, Node *r)
+    {
+        if (l == nullptr)
+            return r;
+        if (r == nullptr)
+            return l;
+        if (l->prio > r->prio)
+        {
+            l->right = merge(l->right, r);
+            update(l);
+            return l;
+        }
+        r->left = merge(l, r->left);
+        update(r);
+        return r;
+    }
+    static void insert(Node *&t, Node *node)
+    {
+        if (t == nullptr)
+        {
+            t = node;
+            return;
+        }
+        if (node->prio > t->prio)
+        {
+            split(t, node->key, node->left, node->right);
+            update(node);
+            t = node;
+            return;
+        }
+        insert(before(node->key, t->key) ? t->left : t->right, node);
+        update(t);
+    }
+    static void erase(Node *&t, const Key &key)
+    {
+        if (t == nullptr)
+            return;
+        if (!before(key, t->key) && !before(t->key, key))
+        {
+            Node *old = t;
+            t = merge(t->left, t->right);
+            delete old;
+            return;
+        }
+        erase(before(key, t->key) ? t->left : t->right, key);
+        update(t);
+    }
+    // 中序遍历，跳过前skip个，最多取limit个
+    void collect(Node *t, size_t &skip, size_t &limit, uint64_t &rank, std::vector<RankEntry> &out)
+    {
+        if (t == nullptr || limit == 0)
+            return;
+        if (skip < size(t->left))
+            collect(t->left, skip, limit, rank, out);
+        else
+            skip -= size(t->left);
+        if (limit == 0)
+            return;
+        if (skip == 0)
+        {
+            RankEntry e = {++rank, t->key.socre, t->key.uid, _users[t->key.uid].username};
+            out.push_back(e);
+            --limit;
+        }
+        else
+        {
+            --skip;
+        }
+        collect(t->right, skip, limit, rank, out);
+    }
+    static void destroy(Node *t)
+    {
+        if (t == nullptr)
+            return;
+        destroy(t->left);
+        destroy(t->right);
+        delete t;
+    }
+
+private:
+    Node *_root;
+    std::minstd_rand _rand;
+    std::unordered_map<uint64_t, User> _users; // uid -> 用户名和当前积分
+};
+
+/**
+ * 排行榜：RankIndex加上一把锁和前几页的响应缓存
+ * 只有影响到前RANK_CACHE_TOP名的变化才让缓存失效，之后第一次请求时重新编码
+ */
+class Leaderboard
+{
+public:
+    Leaderboard() : _top_version(0) {}
+    void set(uint64_t uid, const std::string &username, int socre)
+    {
+        std::lock_guard<std::mutex> lck(_mutex);
+        uint64_t old_rank = 0, new_rank = 0;
+        bool existed = _index.rank(uid, old_rank);
+        _index.set(uid, username, socre);
+        _index.rank(uid, new_rank);
+        if (existed == false)
+            ++_top_version; // 总人数变化了
+        else
+            touch(old_rank, new_rank);
+    }
+    void add(uint64_t uid, int delta)
+    {
+        std::lock_guard<std::mutex> lck(_mutex);
+        uint64_t old_rank = 0, new_rank = 0;
+        if (_index.rank(uid, old_rank) == false)
+            return;
+        _index.add(uid, delta);
+        _index.rank(uid, new_rank);
+        touch(old_rank, new_rank);
+    }
+    // 用户当前的积分(内存中，不访问数据库)，不在排行榜中返回false
+    bool socre(uint64_t uid, int &socre)
+    {
+        std::lock_guard<std::mutex> lck(_mutex);
+        return _index.socre(uid, socre);
+    }
+    // 用户的名次(从1开始)，不在排行榜中返回0
+    uint64_t rank(uint64_t uid)
+    {
+        std::lock_guard<std::mutex> lck(_mutex);
+        uint64_t rank = 0;
+        if (_index.rank(uid, rank) == false)
+            return 0;
+        return rank + 1;
+    }
+    // 从第offset名(从0开始)开始的一页，编码成JSON
+    void page(uint64_t offset, size_t limit, std::string &body)
+    {
+        if (limit == 0 || limit > RANK_MAX_LIMIT)
+            limit = RANK_DEFAULT_LIMIT;
+        bool cacheable = offset + limit <= RANK_CACHE_TOP;
+        std::pair<uint64_t, size_t> key(offset, limit);
+        std::lock_guard<std::mutex> lck(_mutex);
+        if (cacheable)
+        {
+            auto it = _pages.find(key);
+            if (it != _pages.end() && it->second.version == _top_version)
+            {
+                body = it->second.body;
+                return;
+            }
+        }
+        RankPage page;
+        page.offset = offset;
+        page.total = _index.size();
+        _index.range(offset, limit, page.list);
+        json_encode(page, body);
+        if (cacheable)
+        {
+            if (_pages.size() >= RANK_CACHE_PAGES && _pages.find(key) == _pages.end())
+                _pages.clear();
+            CachedPage &cp = _pages[key];
+            cp.version = _top_version;
+            cp.body = body;
+        }
+    }
+    // 以uid为中心的一页
+    void around(uint64_t uid, size_t limit, std::string &body)
+    {
+        if (limit == 0 || limit > RANK_MAX_LIMIT)
+            limit = RANK_DEFAULT_LIMIT;
+        uint64_t r = rank(uid);
+        uint64_t offset = r > limit / 2 ? r - 1 - limit / 2 : 0;
+        page(offset, limit, body);
+    }
+
+private:
+    // 变化涉及前RANK_CACHE_TOP名时让缓存的页面失效（调用时持有_mutex）
+    void touch(uint64_t old_rank, uint64_t new_rank)
+    {
+        if (old_rank < RANK_CACHE_TOP || new_rank < RANK_CACHE_TOP)
+            ++_top_version;
+    }
+
+private:
+    struct CachedPage
+    {
+        uint64_t version;
+        std::string body;
+    };
+    std::mutex _mutex;
+    RankIndex _index;
+    uint64_t _top_version; // 前RANK_CACHE_TOP名每变化一次加1
+    std::map<std::pair<uint64_t, size_t>, CachedPage> _pages; // (offset, limit) -> 编码好的响应
+};
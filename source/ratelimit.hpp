@@ -0,0 +1,149 @@
+#pragma once
+
+#include <chrono>
+#include <cstring>
+#include <list>
+#include <unordered_map>
+
+#include "util.hpp"
+
+#define RATELIMIT_SHARDS 16        // 每个限流器的分片数，减少多线程下的锁竞争
+#define RATELIMIT_MAX_KEYS 65536   // 每个限流器最多跟踪的key(IP/uid)数量，超过后淘汰最久未访问的
+
+// 令牌桶规则：每秒补充rate个令牌，最多累积burst个
+struct RateLimitRule
+{
+    RateLimitRule(double r, double b) : rate(r), burst(b) {}
+    double rate;
+    double burst;
+};
+
+/**
+ * 按key(客户端IP或uid)的令牌桶限流器
+ * key按哈希分片，每个分片一把锁；每个分片用LRU链表限制key的数量，地址大量变化时内存也不会无限增长
+ * 被淘汰的key下次访问时得到一个满的令牌桶，对于长时间不访问的key这和原来的状态是一样的
+ */
+template <class Key>
+class RateLimiter
+{
+public:
+    RateLimiter(const RateLimitRule &rule, size_t max_keys = RATELIMIT_MAX_KEYS)
+        : _rule(rule), _shard_cap(max_keys / RATELIMIT_SHARDS + 1), _rejected(0) {}
+    void set_rule(const RateLimitRule &rule) { _rule = rule; }
+    // 消耗一个令牌，没有令牌时返回false
+    bool allow(const Key &key)
+    {
+        int64_t now = now_us();
+        Shard &shard = _shards[std::hash<Key>()(key) % RATELIMIT_SHARDS];
+        std::lock_guard<std::mutex> lck(shard.mutex);
+        auto it = shard.buckets.find(key);
+        if (it == shard.buckets.end())
+        {
+            if (shard.buckets.size() >= _shard_cap)
+            {
+                // 淘汰最久未访问的key
+                shard.buckets.erase(shard.lru.back());
+                shard.lru.pop_back();
+            }
+            shard.lru.push_front(key);
+            Bucket bucket = {_rule.burst, now, shard.lru.begin()};
+            it = shard.buckets.insert(std::make_pair(key, bucket)).first;
+        }
+        else
+        {
+            shard.lru.splice(shard.lru.begin(), shard.lru, it->second.lru); // 移动到LRU链表头部
+        }
+        Bucket &b = it->second;
+        b.tokens += (now - b.last_us) * _rule.rate / 1000000.0;
+        if (b.tokens > _rule.burst)
+            b.tokens = _rule.burst;
+        b.last_us = now;
+        if (b.tokens < 1.0)
+        {
+            ++_rejected;
+            return false;
+        }
+        b.tokens -= 1.0;
+        return true;
+    }
+    uint64_t rejected() { return _rejected; }
+
+private:
+    static int64_t now_us()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+private:
+    struct Bucket
+    {
+        double tokens;                          // 当前令牌数
+        int64_t last_us;                        // 上一次补充令牌的时间
+        typename std::list<Key>::iterator lru;  // 在LRU链表中的位置
+    };
+    struct Shard
+    {
+        std::mutex mutex;
+        std::unordered_map<Key, Bucket> buckets;
+        std::list<Key> lru; // 头部是最近访问的key
+    };
+    RateLimitRule _rule;
+    size_t _shard_cap;              // 每个分片最多跟踪的key数量
+    std::atomic<uint64_t> _rejected; // 被拒绝的请求数
+    Shard _shards[RATELIMIT_SHARDS];
+};
+
+// 各个接口的限流配置
+struct RateLimitConfig
+{
+    RateLimitConfig()
+        : login_ip(2, 10), reg_ip(0.2, 5), match_uid(2, 5), chat_uid(2, 5) {}
+    RateLimitRule login_ip;  // /login 每个IP
+    RateLimitRule reg_ip;    // /reg 每个IP
+    RateLimitRule match_uid; // match_start/match_stop 每个用户
+    RateLimitRule chat_uid;  // 房间聊天 每个用户
+};
+
+// 服务器使用的全部限流器
+class RequestLimiter
+{
+public:
+    RequestLimiter()
+        : _login(RateLimitConfig().login_ip), _reg(RateLimitConfig().reg_ip),
+          _match(RateLimitConfig().match_uid), _chat(RateLimitConfig().chat_uid), _logged{0, 0, 0, 0} {}
+    // 需要在服务器启动前调用
+    void configure(const RateLimitConfig &conf)
+    {
+        _login.set_rule(conf.login_ip);
+        _reg.set_rule(conf.reg_ip);
+        _match.set_rule(conf.match_uid);
+        _chat.set_rule(conf.chat_uid);
+    }
+    bool allow_login(const std::string &ip) { return _login.allow(ip); }
+    bool allow_reg(const std::string &ip) { return _reg.allow(ip); }
+    bool allow_match(uint64_t uid) { return _match.allow(uid); }
+    bool allow_chat(uint64_t uid) { return _chat.allow(uid); }
+    uint64_t login_rejected() { return _login.rejected(); }
+    uint64_t reg_rejected() { return _reg.rejected(); }
+    uint64_t match_rejected() { return _match.rejected(); }
+    uint64_t chat_rejected() { return _chat.rejected(); }
+    // 和上一次相比有变化时输出累计的拒绝次数（由服务器的统计定时任务调用）
+    void log_stats()
+    {
+        uint64_t now[4] = {login_rejected(), reg_rejected(), match_rejected(), chat_rejected()};
+        if (memcmp(now, _logged, sizeof(now)) == 0)
+            return;
+        memcpy(_logged, now, sizeof(now));
+        INF_LOG("限流拒绝: 登录 %lu 次, 注册 %lu 次, 匹配 %lu 次, 聊天 %lu 次", (unsigned long)now[0],
+                (unsigned long)now[1], (unsigned long)now[2], (unsigned long)now[3]);
+    }
+
+private:
+    RateLimiter<std::string> _login;
+    RateLimiter<std::string> _reg;
+    RateLimiter<uint64_t> _match;
+    RateLimiter<uint64_t> _chat;
+    uint64_t _logged[4]; // 上一次输出的统计，只在统计定时任务中访问
+};
@@ -0,0 +1,341 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#include "store.hpp"
+#include "util.hpp"
+
+#define RESULT_JOURNAL "./results.journal" // 对战结果日志文件
+#define RESULT_BATCH_MAX 256               // 一个事务最多写入的对战结果数
+#define RESULT_FLUSH_INTERVAL 100          // 写入线程攒批的等待时间(ms)
+#define RESULT_MAX_RETRY 5                 // 一批结果连续写入失败的最大重试次数
+#define RESULT_RETRY_BASE 100              // 重试的初始间隔(ms)，每次翻倍
+#define RESULT_RETRY_PAUSE 5000            // 重试次数用完之后，暂停多久再继续写入(ms)
+#define RESULT_COMPACT_SIZE (4 << 20)      // 日志超过这个大小(字节)时压缩
+
+/**
+ * 对战结果的异步写入队列(write-behind)
+ * 游戏结束时房间只把结果追加到日志文件并放入队列就返回，不再在房间的strand上同步执行两次update
+ * 后台写入线程把队列中的结果攒成一批，在一个事务中写入数据库(UserStore::apply_results)，数据库看到的提交次数大大减少
+ *   - 对战记录(双方、时间和编码后的走棋)随结果一起写入日志和队列，和积分在同一个事务中批量insert，游戏过程中不访问数据库
+ *   - 持久性：结果先写入日志文件(write到内核，进程崩溃不会丢失)，写入线程每批提交前fdatasync一次
+ *     每个结果有递增的序号，数据库中的检查点和积分在同一个事务中更新，启动时重放日志中序号大于检查点的结果，不会重复计算
+ *     读不到检查点时不重放(会重复计算)，启动时一直重试到能读取为止
+ *     队列写空时截断日志；日志超过RESULT_COMPACT_SIZE并且是上次压缩后的2倍时压缩，只保留还在队列中的结果
+ *     压缩时写临时文件和fdatasync都不持有锁，push不会等待磁盘；积压很多时压缩的总写入量也和结果数成线性
+ *   - 重试：一批结果写入失败时按指数退避重试RESULT_MAX_RETRY次，仍然失败就放回队列头部，暂停一段时间后继续，结果不会丢弃
+ *     提交失败时事务可能已经提交了(比如commit的响应丢失)，重试前重新读取检查点，去掉已经写入的结果
+ *   - 关闭：析构时把队列中剩余的结果写完，写不进去的留在日志中，下次启动时重放
+ */
+class ResultQueue
+{
+public:
+    ResultQueue(UserStore *ut, const std::string &journal = RESULT_JOURNAL)
+        : _ut(ut), _journal(journal), _fd(-1), _next_seq(1), _stop(false), _unsure(false), _pushed(0), _committed(0),
+          _commits(0), _retries(0), _journal_size(0), _compact_at(RESULT_COMPACT_SIZE)
+    {
+        recover();
+        _th = std::thread(&ResultQueue::run, this);
+    }
+    ~ResultQueue()
+    {
+        {
+            std::lock_guard<std::mutex> lck(_mutex);
+            _stop = true;
+        }
+        _cond.notify_all();
+        _th.join();
+        if (_fd >= 0)
+            close(_fd);
+    }
+    // 记录一局的结果和对战记录，立即返回
+    void push(uint64_t winner, uint64_t loser, GameRecord game = GameRecord())
+    {
+        {
+            std::lock_guard<std::mutex> lck(_mutex);
+            GameResult r = {_next_seq++, winner, loser, std::move(game)};
+            append(r);
+            _queue.push_back(std::move(r));
+        }
+        ++_pushed;
+        _cond.notify_one();
+    }
+    size_t pending()
+    {
+        std::lock_guard<std::mutex> lck(_mutex);
+        return _queue.size();
+    }
+    uint64_t pushed() { return _pushed; }
+    uint64_t committed() { return _committed; }
+    uint64_t commits() { return _commits; }
+    uint64_t retries() { return _retries; }
+
+private:
+    // 日志中一条记录的头部，后面紧跟moves_len个字节的走棋
+    struct JournalHeader
+    {
+        uint64_t seq;
+        uint64_t winner;
+        uint64_t loser;
+        uint64_t white_id;
+        uint64_t black_id;
+        int64_t start_time;
+        int64_t end_time;
+        uint32_t move_count;
+        uint32_t moves_len;
+    };
+    // 打开日志文件，把还没有写入数据库的结果放回队列
+    void recover()
+    {
+        uint64_t checkpoint = read_checkpoint();
+        _next_seq = checkpoint + 1;
+        _fd = open(_journal.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (_fd < 0)
+        {
+            ERR_LOG("打开对战结果日志 %s 失败，结果只保存在内存中", _journal.c_str());
+            return;
+        }
+        std::string data;
+        char buf[4096];
+        ssize_t n;
+        while ((n = read(_fd, buf, sizeof(buf))) > 0)
+            data.append(buf, n);
+        size_t pos = 0;
+        JournalHeader h;
+        while (data.size() - pos >= sizeof(h)) // 末尾不完整的记录是写入时崩溃留下的，忽略
+        {
+            memcpy(&h, data.data() + pos, sizeof(h));
+            if (h.moves_len > GAME_MOVES_MAX || data.size() - pos - sizeof(h) < h.moves_len)
+                break;
+            if (h.seq > checkpoint)
+            {
+                GameRecord game = {h.white_id, h.black_id, 0, h.start_time, h.end_time, (int)h.move_count,
+                                   data.substr(pos + sizeof(h), h.moves_len)};
+                game.winner = h.white_id == 0 ? 0 : h.winner; // 没有对战记录的结果white_id为0
+                GameResult r = {h.seq, h.winner, h.loser, std::move(game)};
+                _queue.push_back(std::move(r));
+            }
+            if (h.seq >= _next_seq)
+                _next_seq = h.seq + 1;
+            pos += sizeof(h) + h.moves_len;
+        }
+        _journal_size = data.size();
+        if (!_queue.empty())
+            INF_LOG("从日志中恢复了 %lu 个还没有写入数据库的对战结果", (unsigned long)_queue.size());
+        else
+            truncate_journal();
+    }
+    // 读取检查点，读不到就一直重试：按0处理会把已经写入的结果再重放一遍，积分重复增加
+    uint64_t read_checkpoint()
+    {
+        uint64_t checkpoint = 0;
+        int delay = RESULT_RETRY_BASE;
+        while (_ut->result_checkpoint(checkpoint) == false)
+        {
+            ERR_LOG("读取对战结果检查点失败，%d ms后重试", delay);
+            std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+            delay = std::min(delay * 2, RESULT_RETRY_PAUSE);
+        }
+        return checkpoint;
+    }
+    // 把一条记录编码到buf的末尾
+    static void encode(const GameResult &r, std::string &buf)
+    {
+        const GameRecord &g = r.game;
+        JournalHeader h = {r.seq, r.winner, r.loser, g.winner == 0 ? 0 : g.white_id, g.black_id, g.start_time, g.end_time,
+                           (uint32_t)g.move_count, (uint32_t)g.moves.size()};
+        buf.append((const char *)&h, sizeof(h));
+        buf.append(g.moves);
+    }
+    // 追加一条记录到日志文件（调用时持有_mutex）
+    void append(const GameResult &r)
+    {
+        if (_fd < 0)
+            return;
+        // 头部和走棋拼成一次write，O_APPEND下一条记录不会和别的记录交错
+        static thread_local std::string buf;
+        buf.clear();
+        encode(r, buf);
+        if (write(_fd, buf.data(), buf.size()) == (ssize_t)buf.size())
+            _journal_size += buf.size();
+        else
+            ERR_LOG("写入对战结果日志失败: %lu 胜 %lu", r.winner, r.loser);
+    }
+    // 截断日志（调用时持有_mutex）
+    void truncate_journal()
+    {
+        if (ftruncate(_fd, 0) != 0)
+            ERR_LOG("截断对战结果日志失败");
+        else
+            _journal_size = 0;
+    }
+    // 提交成功之后由写入线程调用（不持有_mutex）：队列空了就截断日志，日志太大时压缩
+    // 压缩只保留队列中还没有写入数据库的结果：持有锁时编码队列的快照，写临时文件和fdatasync在锁外进行
+    // 然后在锁内补写快照之后push的结果，再rename替换日志，中途崩溃时旧日志仍然完整
+    void compact()
+    {
+        std::string data;
+        uint64_t last_seq = 0;
+        {
+            std::lock_guard<std::mutex> lck(_mutex);
+            if (_fd < 0)
+                return;
+            if (_queue.empty())
+            {
+                truncate_journal();
+                return;
+            }
+            if (_journal_size < _compact_at)
+                return;
+            for (auto &r : _queue)
+                encode(r, data);
+            last_seq = _queue.back().seq;
+        }
+        std::string tmp = _journal + ".tmp";
+        int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (fd < 0)
+        {
+            ERR_LOG("创建对战结果日志临时文件 %s 失败", tmp.c_str());
+            return;
+        }
+        bool ok = write(fd, data.data(), data.size()) == (ssize_t)data.size() && fdatasync(fd) == 0;
+        std::lock_guard<std::mutex> lck(_mutex);
+        if (ok)
+        {
+            // 只有写入线程从队列中取出结果，快照中的结果都还在队列头部，之后的是新push的
+            auto it = _queue.end();
+            while (it != _queue.begin() && (it - 1)->seq > last_seq)
+                --it;
+            std::string rest;
+            for (; it != _queue.end(); ++it)
+                encode(*it, rest);
+            ok = write(fd, rest.data(), rest.size()) == (ssize_t)rest.size() && rename(tmp.c_str(), _journal.c_str()) == 0;
+            if (ok)
+            {
+                close(_fd);
+                _fd = fd;
+                _journal_size = data.size() + rest.size();
+                _compact_at = std::max((size_t)RESULT_COMPACT_SIZE, _journal_size * 2);
+                return;
+            }
+        }
+        ERR_LOG("压缩对战结果日志失败");
+        close(fd);
+        unlink(tmp.c_str());
+        _compact_at = std::max((size_t)RESULT_COMPACT_SIZE, _journal_size * 2); // 不在之后的每一批都重试
+    }
+    // 写入线程
+    void run()
+    {
+        std::vector<GameResult> batch;
+        while (true)
+        {
+            {
+                std::unique_lock<std::mutex> lck(_mutex);
+                _cond.wait(lck, [this]() { return _stop || !_queue.empty(); });
+                if (_queue.empty())
+                    break; // 已经停止并且全部写完
+                // 攒批：再等一小段时间，让更多的结果进入同一个事务
+                if (!_stop && _queue.size() < RESULT_BATCH_MAX)
+                    _cond.wait_for(lck, std::chrono::milliseconds(RESULT_FLUSH_INTERVAL),
+                                   [this]() { return _stop || _queue.size() >= RESULT_BATCH_MAX; });
+                size_t n = std::min(_queue.size(), (size_t)RESULT_BATCH_MAX);
+                batch.assign(_queue.begin(), _queue.begin() + n);
+                _queue.erase(_queue.begin(), _queue.begin() + n);
+            }
+            bool ok = commit(batch);
+            {
+                std::lock_guard<std::mutex> lck(_mutex);
+                if (ok == false)
+                    _queue.insert(_queue.begin(), batch.begin(), batch.end()); // 放回队列头部，保持顺序
+            }
+            if (ok)
+            {
+                compact();
+            }
+            else
+            {
+                ERR_LOG("%lu 个对战结果写入数据库失败，%d ms后重试", (unsigned long)batch.size(), RESULT_RETRY_PAUSE);
+                std::unique_lock<std::mutex> lck(_mutex);
+                if (_cond.wait_for(lck, std::chrono::milliseconds(RESULT_RETRY_PAUSE), [this]() { return _stop; }))
+                    break; // 关闭时数据库仍然不可用，剩下的结果留在日志中
+            }
+        }
+        if (!_queue.empty())
+            ERR_LOG("关闭时还有 %lu 个对战结果没有写入数据库，下次启动时从日志中恢复", (unsigned long)_queue.size());
+    }
+    // 写入一批结果，失败时按指数退避重试
+    bool commit(std::vector<GameResult> &batch)
+    {
+        if (_fd >= 0)
+            fdatasync(_fd);
+        int delay = RESULT_RETRY_BASE;
+        for (int i = 0; i <= RESULT_MAX_RETRY; ++i)
+        {
+            if (i > 0)
+            {
+                ++_retries;
+                std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+                delay *= 2;
+            }
+            // 上一次失败时事务可能已经提交，先按检查点去掉已经写入的结果，读不到检查点就不写
+            if (_unsure && drop_committed(batch) == false)
+                continue;
+            if (batch.empty())
+                return true;
+            if (_ut->apply_results(batch))
+            {
+                _committed += batch.size();
+                ++_commits;
+                return true;
+            }
+            _unsure = true;
+        }
+        return false;
+    }
+    // 去掉序号不大于检查点的结果，读取检查点失败返回false
+    bool drop_committed(std::vector<GameResult> &batch)
+    {
+        uint64_t checkpoint = 0;
+        if (_ut->result_checkpoint(checkpoint) == false)
+            return false;
+        _unsure = false;
+        size_t n = batch.size();
+        batch.erase(std::remove_if(batch.begin(), batch.end(),
+                                   [checkpoint](const GameResult &r) { return r.seq <= checkpoint; }),
+                    batch.end());
+        if (batch.size() < n)
+        {
+            INF_LOG("%lu 个对战结果在失败的提交中已经写入，不再重复写入", (unsigned long)(n - batch.size()));
+            _committed += n - batch.size();
+        }
+        return true;
+    }
+
+private:
+    UserStore *_ut;
+    std::string _journal;
+    int _fd;                        // 日志文件
+    uint64_t _next_seq;             // 下一个结果的序号
+    bool _stop;
+    bool _unsure;                   // 上一次提交失败，不确定事务是否已经生效(只在写入线程访问)
+    std::deque<GameResult> _queue;  // 还没有写入数据库的结果
+    std::mutex _mutex;
+    std::condition_variable _cond;
+    std::atomic<uint64_t> _pushed;    // 放入队列的结果数
+    std::atomic<uint64_t> _committed; // 写入数据库的结果数
+    std::atomic<uint64_t> _commits;   // 提交的事务数
+    std::atomic<uint64_t> _retries;   // 重试次数
+    size_t _journal_size;             // 日志文件的大小
+    size_t _compact_at;               // 日志超过这个大小时压缩
+    std::thread _th;                  // 写入线程，最后构造
+};
@@ -3,12 +3,14 @@
 #include <memory>
 
 #include "db.hpp"
+#include "history.hpp"
+#include "message.hpp"
 #include "online.hpp"
+#include "outbound.hpp"
+#include "protocol.hpp"
+#include "result.hpp"
 #include "util.hpp"
 
-#define BOARD_ROW 19
-#define BOARD_COL 19
-
 typedef enum
 {
     GAME_START,
@@ -23,8 +25,10 @@ typedef enum
 class Room
 {
 public:
-    Room(uint64_t room_id, UserTable *tb_user, OnlineManager *online_user)
-        : _room_id(room_id), _status(GAME_START), _player_count(0), _tb_user(tb_user), _online_user(online_user), _board(BOARD_ROW, std::vector<int>(BOARD_COL, 0))
+    Room(uint64_t room_id, ResultQueue *results, OutboundLimiter *outbound, websocketpp::lib::asio::io_service &ios)
+        : _room_id(room_id), _status(GAME_START), _player_count(0), _results(results), _outbound(outbound),
+          _board(BOARD_ROW, std::vector<int>(BOARD_COL, 0)), _move_count(0), _start_time(time(nullptr)), _strand(ios),
+          _white_binary(false), _black_binary(false)
     {
         DBG_LOG("%lu 房间创建成功", _room_id);
     }
@@ -47,6 +51,24 @@ public:
     }
     uint64_t get_white_user() { return _white_id; }
     uint64_t get_black_user() { return _black_id; }
+    // 绑定玩家在房间中的长连接，广播时直接使用，不再查找在线用户管理模块（在房间strand上调用）
+    // binary表示该连接协商了二进制协议，下棋结果用二进制帧发送
+    void set_conn(uint64_t uid, wsserver_t::connection_ptr conn, bool binary)
+    {
+        if (uid == _white_id)
+        {
+            _white_conn = conn;
+            _white_binary = binary;
+        }
+        else if (uid == _black_id)
+        {
+            _black_conn = conn;
+            _black_binary = binary;
+        }
+    }
+    // 将任务投递到房间的strand上执行：同一个房间的下棋、聊天、退出请求串行处理，不同房间之间可以并行
+    template <class Handler>
+    void post(Handler handler) { _strand.post(handler); }
 
     /*走棋的requset json
     {
@@ -77,66 +99,63 @@ public:
     }
     */
 
+    // 一次下棋操作的结果，JSON响应和二进制响应都由它生成
+    struct ChessResult
+    {
+        ChessCode_t code; // 结果码
+        uint64_t uid;     // 落子方的uid（对方掉线时为掉线方的uid）
+        int row;          // 落子的行号，没有落子时为-1
+        int col;          // 落子的列号，没有落子时为-1
+        uint64_t winner;  // 0-未分胜负， !0-胜利方的uid
+        bool success() const { return code < CHESS_OCCUPIED; }
+    };
+
     // 下棋
-    Json::Value handle_chess(Json::Value &req)
-    {
-        Json::Value resp;
-        resp["optype"] = "put_chess";
-        // 2. 判断是否有用户退出房间
-        int row = req["row"].asInt();
-        int col = req["col"].asInt();
-        int cur_uid = req["uid"].asInt64();
-        if (_player_count == 1)
+    ChessResult handle_chess(uint64_t cur_uid, int row, int col)
+    {
+        ChessResult res = {CHESS_CONTINUE, cur_uid, row, col, 0};
+        // 1. 判断是否有用户退出房间
+        if (_player_count < 2)
         {
-            // 当前一定有1人退出
-            uint64_t winner = 0;
-            if (_online_user->in_game_room(_white_id) == false)
-                winner = _black_id; // 白方退出
-            else
-                winner = _white_id;
-            resp["result"] = true;
-            resp["reason"] = "对方退出，恭喜你赢了!";
-            resp["uid"] = cur_uid;
-            resp["row"] = row;
-            resp["col"] = col;
-            resp["winner"] = Json::Value::UInt64(winner);
-
-            return resp;
+            // 当前一定有1人退出，能够发起下棋的只有留在房间中的玩家
+            res.code = CHESS_OPPONENT_EXIT;
+            res.winner = cur_uid;
+            return res;
         }
-        if (_player_count == 0)
+        // 2. 获取走棋位置，判断是否合法
+        if (row < 0 || row >= BOARD_ROW || col < 0 || col >= BOARD_COL)
         {
-            DBG_LOG("当前房间没有人了，销毁房间");
-            this->~Room();
+            res.code = CHESS_OUT_OF_RANGE;
+            return res;
         }
-        // 3. 获取走棋位置，判断是否合法
         if (_board[row][col] != 0)
         {
             // 走棋不合法
-            resp["result"] = false;
-            resp["reason"] = "走棋不合法，当前位置有棋啦!";
-            return resp;
+            res.code = CHESS_OCCUPIED;
+            return res;
         }
         Color cur_color = cur_uid == _white_id ? WHITE : BLACK;
         _board[row][col] = cur_color;
-        resp["result"] = true;
-        resp["room_id"] = Json::Value::UInt64(_room_id);
-        resp["uid"] = cur_uid;
-        resp["row"] = row;
-        resp["col"] = col;
-        // 4. 判断当前下棋人是否胜利
-        uint64_t winner_id = check_win(row, col, cur_color);
-        if (winner_id == 0) // 目前无人胜利
+        MoveCodec::append(_moves, _move_count++, row, col, cur_color);
+        // 3. 判断当前下棋人是否胜利
+        res.winner = check_win(row, col, cur_color);
+        if (res.winner != 0) // 游戏结束
         {
-            resp["reason"] = "游戏继续";
-            resp["winner"] = 0;
+            res.code = CHESS_WIN;
         }
-        else // 游戏结束
+        return res;
+    }
+    // 处理一次落子：下棋、游戏结束时更新数据库、广播结果（JSON请求和二进制请求都走这里）
+    void handle_move(uint64_t uid, int row, int col)
+    {
+        ChessResult res = handle_chess(uid, row, col);
+        if (res.winner != 0 && _status == GAME_START)
         {
-            // 设置json内容
-            resp["reason"] = "恭喜你，赢了";
-            resp["winner"] = Json::Value::UInt64(winner_id);
+            // 这里就是出现了赢家
+            uint64_t loser_id = (res.winner == _white_id ? _black_id : _white_id);
+            game_over(res.winner, loser_id);
         }
-        return resp;
+        broadcast_chess(res);
     }
 
     // 聊天
@@ -159,106 +178,123 @@ public:
         "uid": 1,
         "message": "赶紧点"
     } */
-    Json::Value handle_chat(Json::Value &req)
+    ChatResp handle_chat(Json::Value &req)
     {
-        Json::Value json_resp;
-        json_resp["optype"] = "chat";
-
         // 2. 检测消息中的敏感词并脱敏
         std::string msg = req["message"].asString();
         replace_sensitive(msg);
-        // 3. 返回消息json_resp
-        json_resp["result"] = true;
-        json_resp["room_id"] = req["room_id"];
-        json_resp["uid"] = req["uid"];
-        json_resp["message"] = msg;
-        return json_resp;
+        // 3. 返回聊天响应(房间号已经校验过，uid由服务器根据连接填写)
+        ChatResp resp = {std::move(msg), _room_id, req["uid"].asUInt64()};
+        return resp;
     }
     // 玩家退出
     void handle_exit(uint64_t uid)
     {
         // 如果是下棋中退出，那么对方胜利，如果是下棋后退出，那么是正常
-        Json::Value json_resp;
         if(_status == GAME_START)
         {
             //游戏中
             uint64_t winner_id = (uid == _white_id ? _black_id : _white_id);
             uint64_t loser_id = uid;
-            // json操作
-            json_resp["optype"] = "put_chess";
-            json_resp["result"] = true;
-            json_resp["reason"] = "对方掉线，不战而胜";
-            json_resp["room_id"] = Json::Value::UInt64(_room_id);
-            json_resp["uid"] = Json::Value::UInt64(uid);
-            json_resp["row"] = -1;
-            json_resp["col"] = -1;
-            json_resp["winner"] = Json::Value::UInt64(winner_id);
-            // 数据库操作
-            _tb_user->win(winner_id);
-            _tb_user->lose(loser_id);
-            _status = GAME_OVER;
+            game_over(winner_id, loser_id);
+            ChessResult res = {CHESS_OPPONENT_OFFLINE, uid, -1, -1, winner_id};
+            broadcast_chess(res);
         }
-        broadcast(json_resp);
+        set_conn(uid, wsserver_t::connection_ptr(), false);
         _player_count--;
     }
     // 一个总的请求函数，里面根据请求分别调用不同的操作
     void handle_request(Json::Value &req)
     {
-        Json::Value json_resp;
+        static thread_local std::string body; // 复用线程的编码缓冲区
         // 1. 检测房间号正确性
         if (req["room_id"].asUInt64() != _room_id)
         {
-            json_resp["result"] = false;
-            json_resp["reason"] = "房间号不匹配!";
-            return broadcast(json_resp);
+            return broadcast(ConstMsg::room_mismatch());
         }
-        json_resp["room_id"] = Json::Value::UInt64(_room_id);
 
         // 2. 根据不同的请求类型调用不同的函数
-        if (req["optype"].asString() == "put_chess")
+        std::string optype = req["optype"].asString();
+        if (optype == "put_chess")
         {
-            json_resp = handle_chess(req);
-            if (json_resp["winner"].asInt64() != 0)
-            {
-                // 这里就是出现了赢家
-                uint64_t winner_id = json_resp["winner"].asInt64();
-                uint64_t loser_id = (winner_id == _white_id ? _black_id : _white_id);
-                // 更新数据库
-                _tb_user->win(winner_id);
-                _tb_user->lose(loser_id);
-                _status = GAME_OVER;
-            }
+            return handle_move(req["uid"].asUInt64(), req["row"].asInt(), req["col"].asInt());
         }
-        else if (req["optype"].asString() == "chat")
+        else if (optype == "chat")
         {
-            json_resp = handle_chat(req);
+            json_encode(handle_chat(req), body);
+            return broadcast(body, MSG_NORMAL); // 聊天是非关键消息，慢客户端积压时可以丢弃
         }
-        else
+        RoomFailResp resp = {optype.c_str(), "出现未知错误!", _room_id};
+        json_encode(resp, body);
+        broadcast(body);
+    }
+
+    // 广播编码好的响应给整个房间的用户
+    void broadcast(const std::string &body, MsgPriority_t prio = MSG_CRITICAL)
+    {
+        if (_white_conn.get() != nullptr)
+        {
+            _outbound->send(_white_conn, body, websocketpp::frame::opcode::text, prio);
+        }
+        if (_black_conn.get() != nullptr)
         {
-            json_resp["optype"] = req["optype"].asString();
-            json_resp["result"] = false;
-            json_resp["reason"] = "出现未知错误!";
+            _outbound->send(_black_conn, body, websocketpp::frame::opcode::text, prio);
         }
-        return broadcast(json_resp);
+    }
+    // 广播下棋结果：使用二进制协议的连接发送二进制帧，其他连接发送JSON，每种格式最多编码一次
+    void broadcast_chess(const ChessResult &res)
+    {
+        std::string json_body, bin_body;
+        send_chess(_white_conn, _white_binary, res, json_body, bin_body);
+        send_chess(_black_conn, _black_binary, res, json_body, bin_body);
     }
 
-    // 广播rsp信息给整个房间的用户
-    void broadcast(Json::Value &rsp)
-    {
-        // 1. 序列化相应信息
-        std::string body;
-        JsonUtil::serialize(rsp, &body);
-        // 2. 广播相应信息
-        wsserver_t::connection_ptr wconn = _online_user->get_conn_from_room(_white_id);
-        if (wconn.get() != nullptr)
+private:
+    void send_chess(wsserver_t::connection_ptr &conn, bool binary, const ChessResult &res,
+                    std::string &json_body, std::string &bin_body)
+    {
+        if (conn.get() == nullptr)
+            return;
+        if (binary)
         {
-            wconn->send(body);
+            if (bin_body.empty())
+                BinaryProto::encode_chess(bin_body, res.code, res.row, res.col, color_of(res.uid),
+                                          res.winner == 0 ? 0 : color_of(res.winner));
+            _outbound->send(conn, bin_body, websocketpp::frame::opcode::binary);
         }
-        wsserver_t::connection_ptr bconn = _online_user->get_conn_from_room(_black_id);
-        if (bconn.get() != nullptr)
+        else
+        {
+            if (json_body.empty())
+                chess_json(res, json_body);
+            _outbound->send(conn, json_body);
+        }
+    }
+    int color_of(uint64_t uid) { return uid == _white_id ? WHITE : (uid == _black_id ? BLACK : 0); }
+    void chess_json(const ChessResult &res, std::string &out)
+    {
+        if (res.success())
+        {
+            PutChessResp resp = {res.col, chess_reason(res.code), _room_id, res.row, res.uid, res.winner};
+            json_encode(resp, out);
+        }
+        else
+        {
+            FailResp resp = {"put_chess", chess_reason(res.code)};
+            json_encode(resp, out);
+        }
+    }
+    static const char *chess_reason(ChessCode_t code)
+    {
+        switch (code)
         {
-            bconn->send(body);
+        case CHESS_CONTINUE: return "游戏继续";
+        case CHESS_WIN: return "恭喜你，赢了";
+        case CHESS_OPPONENT_EXIT: return "对方退出，恭喜你赢了!";
+        case CHESS_OPPONENT_OFFLINE: return "对方掉线，不战而胜";
+        case CHESS_OCCUPIED: return "走棋不合法，当前位置有棋啦!";
+        case CHESS_OUT_OF_RANGE: return "走棋不合法，超出棋盘范围!";
         }
+        return "出现未知错误!";
     }
 
 private:
@@ -317,6 +353,13 @@ private:
         }
         return 0;
     }
+    // 游戏结束：结果和对战记录交给写入队列，由后台线程批量写入数据库
+    void game_over(uint64_t winner, uint64_t loser)
+    {
+        GameRecord game = {_white_id, _black_id, winner, _start_time, time(nullptr), _move_count, std::move(_moves)};
+        _results->push(winner, loser, std::move(game));
+        _status = GAME_OVER;
+    }
 
 private:
     uint64_t _room_id;                    // 房间号
@@ -324,9 +367,17 @@ private:
     int _player_count;                    // 当前房间人数
     uint64_t _white_id;                   // 白色持方的id
     uint64_t _black_id;                   // 黑色持方的id
-    UserTable *_tb_user;                  // UserTable句柄
-    OnlineManager *_online_user;          // 在线用户句柄
+    ResultQueue *_results;                // 对战结果写入队列
+    OutboundLimiter *_outbound;           // 发送限流句柄
     std::vector<std::vector<int>> _board; // 当前房间的棋盘
+    std::string _moves;                   // 编码后的走棋记录(MoveCodec)
+    int _move_count;                      // 走棋的步数
+    int64_t _start_time;                  // 房间创建的时间(unix时间戳，秒)
+    websocketpp::lib::asio::io_service::strand _strand; // 串行化本房间所有处理函数的strand
+    wsserver_t::connection_ptr _white_conn;             // 白方的长连接，只在strand上访问
+    wsserver_t::connection_ptr _black_conn;             // 黑方的长连接，只在strand上访问
+    bool _white_binary;                                 // 白方连接是否使用二进制协议
+    bool _black_binary;                                 // 黑方连接是否使用二进制协议
 };
 
 using room_ptr = std::shared_ptr<Room>;
@@ -334,8 +385,8 @@ using room_ptr = std::shared_ptr<Room>;
 class RoomManager
 {
 public:
-    RoomManager(UserTable *ut, OnlineManager *om)
-        : _next_rid(1), _utb(ut), _om(om)
+    RoomManager(ResultQueue *results, OnlineManager *om, OutboundLimiter *outbound, websocketpp::lib::asio::io_service *ios)
+        : _next_rid(1), _results(results), _om(om), _outbound(outbound), _ios(ios)
     {
         DBG_LOG("房间管理模块初始化成功");
     }
@@ -359,7 +410,7 @@ public:
         }
         // 2. 如果都在大厅的话创建一个房间
         std::lock_guard<std::mutex> lck(_mutex); // 分配房间号的过程要保证线程安全
-        room_ptr rp(new Room(_next_rid, _utb, _om));
+        room_ptr rp(new Room(_next_rid, _results, _outbound, *_ios));
         // 3. 将用户uid1和uid2添加到房间中，添加uid和rid的映射
         rp->add_black_user(uid1);
         rp->add_white_user(uid2);
@@ -389,6 +440,8 @@ public:
     // 通过用户id获取房间指针
     room_ptr get_room_by_uid(uint64_t uid)
     {
+        // 多线程下_users也会被并发修改，查找uid->rid->room要在同一把锁内完成
+        std::unique_lock<std::mutex> lock(_mutex);
         auto ret1 = _users.find(uid);
         if(ret1 == _users.end())
         {
@@ -396,15 +449,13 @@ public:
             return room_ptr();
         }
         auto rid = ret1->second;
-        room_ptr rp = get_room_by_rid(rid);
-        // auto ret2 = _rooms.find(rid);
-        // if(ret2 == _rooms.end())
-        // {
-        //     DBG_LOG("不存在该房间号为 %lu 的房间", rid);
-        //     return room_ptr();
-        // }
-        // return ret2->second;
-        return rp;
+        auto ret2 = _rooms.find(rid);
+        if(ret2 == _rooms.end())
+        {
+            DBG_LOG("不存在该房间号为 %lu 的房间", rid);
+            return room_ptr();
+        }
+        return ret2->second;
     }
     //  通过rid销毁房间 
     void remove_room(uint64_t rid)
@@ -434,9 +485,14 @@ public:
         {
             return;
         }
-        // 2. 从房间中移除uid
+        // 2. 退出操作和下棋操作一样投递到房间的strand上，保证handle_request和handle_exit不会并发执行
+        rp->post(std::bind(&RoomManager::handle_room_exit, this, rp, uid));
+    }
+private:
+    // 在房间strand上执行：从房间中移除uid，如果房间中没有用户了就销毁房间
+    void handle_room_exit(room_ptr rp, uint64_t uid)
+    {
         rp->handle_exit(uid);
-        // 3. 如果房间中没有用户了就销毁房间
         // std::cout << "房间：" << rp->id() << " 内用户个数为：" << rp->player_count() << " 个" << std::endl;
         if(rp->player_count() == 0)
         { 
@@ -446,8 +502,10 @@ public:
 private:
     uint64_t _next_rid; // 唯一的房间号
     std::mutex _mutex;  // 互斥锁保护分配房间号的过程
-    UserTable *_utb;    // 用户信息句柄
+    ResultQueue *_results; // 对战结果写入队列
     OnlineManager *_om; // 在线用户管理句柄
+    OutboundLimiter *_outbound; // 发送限流句柄
+    websocketpp::lib::asio::io_service *_ios; // 服务器的io_service，用于给每个房间创建strand
     std::unordered_map<uint64_t, room_ptr> _rooms; // 房间号和房间指针的映射
     std::unordered_map<uint64_t, uint64_t> _users; // 用户id和房间id的映射
 };
@@ -1,56 +1,127 @@
 #pragma once
 
+#include <thread>
+#include <vector>
+
+#include "asset.hpp"
 #include "db.hpp"
+#include "heartbeat.hpp"
 #include "matcher.hpp"
+#include "memstore.hpp"
+#include "message.hpp"
 #include "online.hpp"
+#include "outbound.hpp"
+#include "ratelimit.hpp"
+#include "result.hpp"
 #include "room.hpp"
 #include "session.hpp"
+#include "token.hpp"
 #include "util.hpp"
 
 #define WEBROOT "./webroot"
+#define DEFAULT_THREAD_COUNT 0 // 运行事件循环的线程数，0表示使用机器的CPU核数
+#define STATS_LOG_INTERVAL 60000 // 定时输出运行统计的间隔(ms)
+
+typedef enum
+{
+    ROUTE_HALL, // 游戏大厅的长连接
+    ROUTE_ROOM  // 游戏房间的长连接
+} Route_t;
+
+// websocket长连接的上下文：在连接建立时完成路由、登录验证和房间查找，绑定到连接上
+struct ConnContext
+{
+    ConnContext(Route_t r, const session_ptr &sp, const room_ptr &room, bool bin)
+        : route(r), uid(sp->get_user()), ssp(sp), rp(room), binary(bin) {}
+    Route_t route;   // 连接类型
+    uint64_t uid;    // 连接对应的用户id
+    session_ptr ssp; // 连接对应的session
+    room_ptr rp;     // 游戏房间连接所属的房间，大厅连接为空
+    bool binary;     // 是否协商了二进制子协议(BINARY_SUBPROTOCOL)
+};
 
 class Server
 {
 public:
+    // 使用mysql存储用户数据
     Server(const std::string &host, const std::string &user, const std::string &password,
            const std::string &db, uint16_t port, const std::string &webroot = WEBROOT)
-        : _ut(host, user, password, db, port), _rm(&_ut, &_om), _sm(&_wssvr), _mm(&_ut, &_om, &_rm), _web_root(webroot)
+        : Server(std::unique_ptr<UserStore>(new UserTable(host, user, password, db, port)), webroot) {}
+    // 使用指定的存储，比如压测时使用MemoryUserStore，不需要数据库
+    Server(std::unique_ptr<UserStore> store, const std::string &webroot = WEBROOT)
+        : _web_root(webroot), _assets(webroot), _heartbeat(&_outbound), _ut(std::move(store)), _results(_ut.get()), _rm(&_results, &_om, &_outbound, &_ios), _sm(SESSION_FILE), _mm(_ut.get(), &_om, &_rm, &_outbound, &_ios)
     {
         _wssvr.set_access_channels(websocketpp::log::alevel::none); // 设置成为禁止打印所有日志
-        _wssvr.init_asio();
+        _wssvr.init_asio(&_ios); // 使用外部的io_service，以便房间管理模块在构造时就能用它创建strand
         _wssvr.set_reuse_addr(true);
         _wssvr.set_http_handler(std::bind(&Server::http_callback, this, std::placeholders::_1));
+        _wssvr.set_validate_handler(std::bind(&Server::wsvalidate_callback, this, std::placeholders::_1));
         _wssvr.set_open_handler(std::bind(&Server::wsopen_callback, this, std::placeholders::_1));
         _wssvr.set_close_handler(std::bind(&Server::wsclose_callback, this, std::placeholders::_1));
         _wssvr.set_message_handler(std::bind(&Server::wsmsg_callback, this, std::placeholders::_1, std::placeholders::_2));
+        _wssvr.set_pong_handler(std::bind(&Server::wspong_callback, this, std::placeholders::_1, std::placeholders::_2));
+        // 加载静态资源缓存，并启动定时检查文件变化的任务
+        _assets.load();
+        _wssvr.set_timer(ASSET_CHECK_INTERVAL, std::bind(&Server::asset_refresh, this, std::placeholders::_1));
     }
     ~Server()
     {
     }
-    void start(int port)
+    // 设置长连接的发送限流策略，需要在start之前调用
+    void set_outbound_config(const OutboundConfig &conf) { _outbound.configure(conf); }
+    // 设置长连接的心跳间隔和超时时间(ms)，需要在start之前调用
+    void set_heartbeat(int interval_ms, int timeout_ms) { _heartbeat.configure(interval_ms, timeout_ms); }
+    // 设置登录、注册、匹配、聊天的限流规则，需要在start之前调用
+    void set_rate_limit(const RateLimitConfig &conf) { _limiter.configure(conf); }
+    // 使用签名令牌代替session表：SSID cookie中携带签名过的uid和过期时间，验证不需要查找session，重启和多进程之间都有效
+    // 多次调用就是密钥轮换，新令牌使用最后设置的密钥，之前的密钥签发的令牌在过期前仍然有效，需要在start之前第一次调用
+    void set_token_key(uint8_t kid, const std::string &secret) { _tokens.rotate(kid, secret); }
+    // thread_count: 运行事件循环的线程数，所有线程共同执行同一个io_service，<=0时使用CPU核数
+    void start(int port, int thread_count = DEFAULT_THREAD_COUNT)
     {
+        if (thread_count <= 0)
+            thread_count = std::thread::hardware_concurrency();
+        if (thread_count <= 0)
+            thread_count = 1;
         _wssvr.listen(port);
         _wssvr.start_accept();
+        _wssvr.set_timer(_heartbeat.interval(), std::bind(&Server::heartbeat_sweep, this, std::placeholders::_1));
+        _wssvr.set_timer(SESSION_SWEEP_INTERVAL, std::bind(&Server::session_sweep, this, std::placeholders::_1));
+        _wssvr.set_timer(STATS_LOG_INTERVAL, std::bind(&Server::stats_log, this, std::placeholders::_1));
+        // 当前线程也参与事件循环，所以只需要额外创建thread_count-1个工作线程
+        std::vector<std::thread> workers;
+        for (int i = 1; i < thread_count; ++i)
+        {
+            workers.push_back(std::thread(&wsserver_t::run, &_wssvr));
+        }
+        INF_LOG("服务器启动，端口: %d，事件循环线程数: %d", port, thread_count);
         _wssvr.run();
+        for (auto &th : workers)
+        {
+            th.join();
+        }
     }
 
 private:
     void file_handle(wsserver_t::connection_ptr &conn) // 静态页面获取请求
     {
-        // 1. 获取uri静态资源路径
-        websocketpp::http::parser::request req = conn->get_request();
-        std::string uri = req.get_uri();
-        std::string real_path = _web_root + uri;
-        if (real_path.back() == '/')
+        // 1. 获取uri静态资源路径（去掉查询字符串）
+        std::string uri = conn->get_request().get_uri();
+        size_t qpos = uri.find('?');
+        if (qpos != std::string::npos)
         {
-            real_path += "login.html";
+            uri.erase(qpos);
         }
-        Json::Value resp;
-        std::string body;
-        bool ret = FilereadUtil::read(real_path, body);
-        if (ret == false)
+        if (uri.back() == '/')
         {
-            // 文件读取失败，文件不存在
+            uri += "login.html";
+        }
+        // 2. 从静态资源缓存中获取文件，请求路径上不访问文件系统
+        asset_ptr ap = _assets.get(uri);
+        if (ap.get() == nullptr)
+        {
+            // 文件不存在
+            std::string body;
             body += "<html>";
             body += "<head>";
             body += "<meta charset='UTF-8'/>";
@@ -62,20 +133,99 @@ private:
             conn->set_body(body);
             return;
         }
-        else
+        conn->append_header("ETag", ap->etag);
+        conn->append_header("Last-Modified", ap->last_modified);
+        conn->append_header("Cache-Control", "no-cache"); // 浏览器每次都带条件请求来验证，文件没变化时只返回304
+        // 3. 条件请求：资源没有变化就返回304，不带正文
+        const std::string &if_none_match = conn->get_request_header("If-None-Match");
+        const std::string &if_modified_since = conn->get_request_header("If-Modified-Since");
+        if ((!if_none_match.empty() && (if_none_match.find(ap->etag) != std::string::npos || if_none_match == "*")) ||
+            (if_none_match.empty() && if_modified_since == ap->last_modified))
         {
-            conn->set_status(websocketpp::http::status_code::ok);
-            conn->set_body(body);
+            conn->set_status(websocketpp::http::status_code::not_modified);
+            return;
         }
+        conn->append_header("Content-Type", ap->content_type);
+        conn->append_header("Accept-Ranges", "bytes");
+        // 4. 范围请求：只返回请求的那一段，大文件可以被客户端分段下载，不用一次整体拷贝
+        const std::string &range = conn->get_request_header("Range");
+        const std::string &if_range = conn->get_request_header("If-Range");
+        if (!range.empty() && (if_range.empty() || if_range == ap->etag || if_range == ap->last_modified))
+        {
+            size_t start = 0, end = 0;
+            RangeResult_t rr = AssetCache::parse_range(range, ap->length(), start, end);
+            if (rr == RANGE_UNSATISFIABLE)
+            {
+                conn->append_header("Content-Range", "bytes */" + std::to_string(ap->length()));
+                conn->set_status(websocketpp::http::status_code::request_range_not_satisfiable);
+                return;
+            }
+            if (rr == RANGE_OK)
+            {
+                conn->append_header("Content-Range", "bytes " + std::to_string(start) + "-" + std::to_string(end) +
+                                                         "/" + std::to_string(ap->length()));
+                conn->set_status(websocketpp::http::status_code::partial_content);
+                conn->set_body(std::string(ap->data() + start, end - start + 1));
+                return;
+            }
+        }
+        // 5. 客户端支持gzip并且有预压缩版本时返回压缩后的内容
+        if (!ap->gzip_body.empty())
+        {
+            conn->append_header("Vary", "Accept-Encoding");
+            if (conn->get_request_header("Accept-Encoding").find("gzip") != std::string::npos)
+            {
+                conn->append_header("Content-Encoding", "gzip");
+                conn->set_status(websocketpp::http::status_code::ok);
+                conn->set_body(ap->gzip_body);
+                return;
+            }
+        }
+        conn->set_status(websocketpp::http::status_code::ok);
+        conn->set_body(ap->body);
+    }
+    // 定时检查webroot中的文件是否有变化，有变化就更新缓存
+    void asset_refresh(const websocketpp::lib::error_code &ec)
+    {
+        if (ec)
+            return;
+        _assets.refresh();
+        _wssvr.set_timer(ASSET_CHECK_INTERVAL, std::bind(&Server::asset_refresh, this, std::placeholders::_1));
+    }
+    // 定时的心跳检查：一个定时任务处理所有长连接
+    void heartbeat_sweep(const websocketpp::lib::error_code &ec)
+    {
+        if (ec)
+            return;
+        _heartbeat.sweep(_wssvr);
+        _wssvr.set_timer(_heartbeat.interval(), std::bind(&Server::heartbeat_sweep, this, std::placeholders::_1));
+    }
+    // 定时清理过期的session
+    void session_sweep(const websocketpp::lib::error_code &ec)
+    {
+        if (ec)
+            return;
+        size_t count = _sm.sweep();
+        if (count > 0)
+            DBG_LOG("清理了 %lu 个过期的session", (unsigned long)count);
+        _wssvr.set_timer(SESSION_SWEEP_INTERVAL, std::bind(&Server::session_sweep, this, std::placeholders::_1));
     }
-    void http_response(wsserver_t::connection_ptr &conn, bool result, const std::string &reason,
+    // 定时输出运行统计，没有变化的不输出
+    void stats_log(const websocketpp::lib::error_code &ec)
+    {
+        if (ec)
+            return;
+        _outbound.log_stats();
+        _limiter.log_stats();
+        _ut->log_stats();
+        _wssvr.set_timer(STATS_LOG_INTERVAL, std::bind(&Server::stats_log, this, std::placeholders::_1));
+    }
+    void http_response(wsserver_t::connection_ptr &conn, bool result, const char *reason,
                        websocketpp::http::status_code::value code)
     {
-        Json::Value resp_json;
-        resp_json["result"] = result;
-        resp_json["reason"] = reason;
+        ResultResp resp = {reason, result};
         std::string body;
-        JsonUtil::serialize(resp_json, &body);
+        json_encode(resp, body);
         conn->set_status(code);
         conn->set_body(body);
         conn->append_header("Content-Type", "application/json");
@@ -98,7 +248,7 @@ private:
             DBG_LOG("输入用户名密码不完整");
             return http_response(conn, false, "请输入用户名/密码", websocketpp::http::status_code::bad_request);
         }
-        ret = _ut.insert(req);
+        ret = _ut->insert(req);
         if (ret == false)
         {
             DBG_LOG("向数据库中插入失败");
@@ -125,20 +275,25 @@ private:
             DBG_LOG("输入用户名密码不完整");
             return http_response(conn, false, "请输入用户名/密码", websocketpp::http::status_code::bad_request);
         }
-        ret = _ut.login(user);
+        ret = _ut->login(user);
         if (ret == false)
         {
             DBG_LOG("输入用户名或密码错误");
             return http_response(conn, false, "用户名或密码错误", websocketpp::http::status_code::bad_request);
         }
-        // 4. 给客户端创建session
+        // 4. 给客户端创建session，令牌模式下直接签发令牌
+        if (_tokens.ready())
+        {
+            conn->append_header("Set-Cookie", "SSID=" + _tokens.issue(user["id"].asUInt64()));
+            return http_response(conn, true, "登录成功", websocketpp::http::status_code::ok);
+        }
         session_ptr ssp = _sm.createSession(user["id"].asUInt64(), LOGIN);
         if (ssp.get() == nullptr)
         {
             DBG_LOG("创建会话失败");
             return http_response(conn, false, "创建会话失败", websocketpp::http::status_code::bad_request);
         }
-        _sm.setExpirationTime(ssp->ssid(), SESSION_TIMEOUT);
+        _sm.setExpirationTime(ssp, SESSION_TIMEOUT);
         // 5. 构造json_resp返回（包括响应头部Set-Cookie）将sessionid返回
         std::string cookie_ssid = "SSID=" + std::to_string(ssp->ssid());
         conn->append_header("Set-Cookie", cookie_ssid);
@@ -168,11 +323,164 @@ private:
         }
         return false;
     }
+    // 从uri的查询字符串中获取key对应的值: /leaderboard?offset=0&limit=20
+    bool get_query_val(const std::string &uri, const std::string &key, std::string &value)
+    {
+        size_t pos = uri.find('?');
+        if (pos == std::string::npos)
+            return false;
+        std::vector<std::string> query_arr;
+        StringUtil::spilt(uri.substr(pos + 1), "&", query_arr);
+        for (auto &str : query_arr)
+        {
+            size_t eq = str.find('=');
+            if (eq != std::string::npos && str.compare(0, eq, key) == 0)
+            {
+                value = str.substr(eq + 1);
+                return true;
+            }
+        }
+        return false;
+    }
+    // 排行榜请求: /leaderboard?offset=0&limit=20，或者/leaderboard?around=me&limit=20获取自己附近的一页
+    void leaderboard(wsserver_t::connection_ptr &conn, const std::string &uri)
+    {
+        std::string offset_str, limit_str, around;
+        uint64_t offset = 0;
+        size_t limit = RANK_DEFAULT_LIMIT;
+        if (get_query_val(uri, "offset", offset_str))
+            offset = strtoull(offset_str.c_str(), nullptr, 10);
+        if (get_query_val(uri, "limit", limit_str))
+            limit = strtoul(limit_str.c_str(), nullptr, 10);
+        std::string body;
+        if (get_query_val(uri, "around", around) && around == "me")
+        {
+            // 需要登录，通过cookie中的ssid找到用户
+            session_ptr ssp = cookie_session(conn);
+            if (ssp.get() == nullptr)
+                return http_response(conn, false, "登录过期，请重新登录", websocketpp::http::status_code::bad_request);
+            _ut->leaderboard().around(ssp->get_user(), limit, body);
+        }
+        else
+        {
+            _ut->leaderboard().page(offset, limit, body);
+        }
+        conn->set_body(body);
+        conn->append_header("Content-Type", "application/json");
+        conn->set_status(websocketpp::http::status_code::ok);
+    }
+    // 通过cookie中的ssid找到会话，没有登录或者已经过期返回空
+    session_ptr cookie_session(wsserver_t::connection_ptr &conn)
+    {
+        std::string ssid_str;
+        if (get_cookie_val(conn->get_request_header("Cookie"), "SSID", ssid_str) == false)
+            return session_ptr();
+        session_ptr ssp = find_session(ssid_str);
+        if (ssp.get() != nullptr)
+            renew_token(conn, ssp);
+        return ssp;
+    }
+    // 令牌模式下没有可以滑动的过期时间，令牌剩余的有效期不到TOKEN_RENEW时在响应中签发新的令牌
+    void renew_token(wsserver_t::connection_ptr &conn, const session_ptr &ssp)
+    {
+        if (_tokens.ready() == false || ssp->get_expire() - (int64_t)time(nullptr) * 1000 >= (int64_t)TOKEN_RENEW * 1000)
+            return;
+        conn->append_header("Set-Cookie", "SSID=" + _tokens.issue(ssp->get_user()));
+    }
+    // 根据cookie中SSID的值找到会话
+    // 令牌模式下验证签名，为这次请求临时构造一个不在session表中的会话，请求处理完就释放
+    session_ptr find_session(const std::string &ssid_str)
+    {
+        if (_tokens.ready())
+        {
+            uint64_t uid = 0;
+            int64_t expire = 0;
+            if (_tokens.verify(ssid_str, uid, expire) == false)
+                return session_ptr();
+            session_ptr ssp(new Session(0));
+            ssp->set_user(uid);
+            ssp->set_status(LOGIN);
+            ssp->set_expire(expire * 1000); // 令牌的过期时间，用于判断是否需要重新签发
+            return ssp;
+        }
+        return _sm.getSessionBySsid(strtoull(ssid_str.c_str(), nullptr, 10));
+    }
+    // 注销：令牌模式下撤销令牌，否则删除session，并让浏览器删除cookie
+    void logout(wsserver_t::connection_ptr &conn)
+    {
+        std::string ssid_str;
+        if (get_cookie_val(conn->get_request_header("Cookie"), "SSID", ssid_str))
+        {
+            if (_tokens.ready())
+                _tokens.revoke(ssid_str);
+            else
+                _sm.removeSession(strtoull(ssid_str.c_str(), nullptr, 10));
+        }
+        conn->append_header("Set-Cookie", "SSID=; Max-Age=0");
+        http_response(conn, true, "注销成功", websocketpp::http::status_code::ok);
+    }
+    // 对战记录请求: /history?uid=1&before=0&limit=20，不带uid时查询自己的
+    // keyset分页：before是上一页返回的next，第一页不带或者为0
+    void history(wsserver_t::connection_ptr &conn, const std::string &uri)
+    {
+        std::string val;
+        uint64_t uid = 0, before = UINT64_MAX;
+        int limit = HISTORY_DEFAULT_LIMIT;
+        if (get_query_val(uri, "uid", val))
+        {
+            uid = strtoull(val.c_str(), nullptr, 10);
+        }
+        else
+        {
+            session_ptr ssp = cookie_session(conn);
+            if (ssp.get() == nullptr)
+                return http_response(conn, false, "登录过期，请重新登录", websocketpp::http::status_code::bad_request);
+            uid = ssp->get_user();
+        }
+        if (get_query_val(uri, "before", val) && strtoull(val.c_str(), nullptr, 10) != 0)
+            before = strtoull(val.c_str(), nullptr, 10);
+        if (get_query_val(uri, "limit", val))
+            limit = atoi(val.c_str());
+        if (limit <= 0 || limit > HISTORY_MAX_LIMIT)
+            limit = HISTORY_DEFAULT_LIMIT;
+        HistoryPage page;
+        if (_ut->history(uid, before, limit, page.list) == false)
+            return http_response(conn, false, "查询对战记录失败", websocketpp::http::status_code::internal_server_error);
+        page.next = (int)page.list.size() == limit ? page.list.back().id : 0;
+        std::string body;
+        json_encode(page, body);
+        conn->set_body(body);
+        conn->append_header("Content-Type", "application/json");
+        conn->set_status(websocketpp::http::status_code::ok);
+    }
+    // 对战回放请求: /replay?id=15，返回完整的走棋顺序
+    void replay(wsserver_t::connection_ptr &conn, const std::string &uri)
+    {
+        std::string val;
+        if (get_query_val(uri, "id", val) == false)
+            return http_response(conn, false, "缺少对战记录id", websocketpp::http::status_code::bad_request);
+        ReplayResp resp;
+        resp.id = strtoull(val.c_str(), nullptr, 10);
+        GameRecord game;
+        if (_ut->replay(resp.id, game) == false)
+            return http_response(conn, false, "找不到对战记录", websocketpp::http::status_code::not_found);
+        if (MoveCodec::decode(game.moves, game.move_count, resp.moves) == false)
+            return http_response(conn, false, "对战记录已损坏", websocketpp::http::status_code::internal_server_error);
+        resp.black_id = game.black_id;
+        resp.end_time = game.end_time;
+        resp.start_time = game.start_time;
+        resp.white_id = game.white_id;
+        resp.winner = game.winner;
+        std::string body;
+        json_encode(resp, body);
+        conn->set_body(body);
+        conn->append_header("Content-Type", "application/json");
+        conn->set_status(websocketpp::http::status_code::ok);
+    }
     void info(wsserver_t::connection_ptr &conn) // 用户信息获取功能请求
     {
         // 获取请求正文
         // 1. 获取请求中的Cookie，从其中获取ssid
-        Json::Value err_resp;
         std::string cookie_str = conn->get_request_header("Cookie");
         if (cookie_str.empty())
         {
@@ -188,7 +496,7 @@ private:
             return http_response(conn, false, "找不到ssid信息，请重新登录", websocketpp::http::status_code::bad_request);
         }
         // 2. 在session管理中查找对应的会话信息
-        session_ptr ssp = _sm.getSessionBySsid(std::stol(ssid_str));
+        session_ptr ssp = find_session(ssid_str);
         if (ssp.get() == nullptr)
         {
             // 没有session，就认为“会话信息已经过期，请重新登录”
@@ -197,53 +505,87 @@ private:
         // 3. 从数据库中获取用户信息组织并返回
         uint64_t uid = ssp->get_user();
         Json::Value user_info;
-        ret = _ut.select_by_id(uid, user_info);
+        ret = _ut->select_by_id(uid, user_info);
         if (ret == false)
         {
             // 找不到用户信息
             return http_response(conn, false, "找不到用户信息，请重新登录", websocketpp::http::status_code::bad_request);
         }
+        user_info["rank"] = Json::Value::UInt64(_ut->leaderboard().rank(uid)); // 0表示还不在排行榜中
         std::string body;
         JsonUtil::serialize(user_info, &body);
         conn->set_body(body);
         conn->append_header("Content-Type", "application/json");
         conn->set_status(websocketpp::http::status_code::ok);
-        // 刷新session时间
-        _sm.setExpirationTime(ssp->ssid(), SESSION_TIMEOUT);
+        // 刷新session时间，令牌模式下快过期时重新签发（要在刷新之前判断，刷新会改掉临时会话中令牌的过期时间）
+        renew_token(conn, ssp);
+        _sm.setExpirationTime(ssp, SESSION_TIMEOUT);
     }
     void http_callback(websocketpp::connection_hdl hdl) // 处理http请求的回调函数
     {
         wsserver_t::connection_ptr conn = _wssvr.get_con_from_hdl(hdl);
-        websocketpp::http::parser::request req = conn->get_request();
-        std::string method = req.get_method();
-        std::string uri = req.get_uri();
+        const websocketpp::http::parser::request &req = conn->get_request();
+        const std::string &method = req.get_method();
+        const std::string &uri = req.get_uri();
         if (method == "POST" && uri == "/reg")
+        {
+            if (_limiter.allow_reg(client_ip(conn)) == false)
+                return rate_limited(conn);
             return reg(conn);
+        }
         else if (method == "POST" && uri == "/login")
+        {
+            if (_limiter.allow_login(client_ip(conn)) == false)
+                return rate_limited(conn);
             return login(conn);
+        }
+        else if (method == "POST" && uri == "/logout")
+            return logout(conn);
         else if (method == "GET" && uri == "/info")
             return info(conn);
+        else if (method == "GET" && uri.compare(0, uri.find('?'), "/leaderboard") == 0)
+            return leaderboard(conn, uri);
+        else if (method == "GET" && uri.compare(0, uri.find('?'), "/history") == 0)
+            return history(conn, uri);
+        else if (method == "GET" && uri.compare(0, uri.find('?'), "/replay") == 0)
+            return replay(conn, uri);
         else
             return file_handle(conn);
     }
-    void ws_resp(wsserver_t::connection_ptr &conn, Json::Value &resp)
+    // 获取客户端的IP地址，用于按IP限流
+    std::string client_ip(wsserver_t::connection_ptr &conn)
     {
-        std::string body;
-        JsonUtil::serialize(resp, &body);
-        conn->send(body);
+        websocketpp::lib::asio::error_code ec;
+        websocketpp::lib::asio::ip::tcp::endpoint ep = conn->get_raw_socket().remote_endpoint(ec);
+        if (ec)
+            return std::string();
+        return ep.address().to_string();
     }
+    // 请求被限流：返回预先生成好的响应，不访问数据库也不构建json
+    void rate_limited(wsserver_t::connection_ptr &conn)
+    {
+        conn->set_status(websocketpp::http::status_code::too_many_requests);
+        conn->set_body(ConstMsg::http_limited());
+        conn->append_header("Content-Type", "application/json");
+        conn->append_header("Retry-After", "1");
+    }
+    // 固定格式的消息直接编码，内容不变的消息直接发送预先编码好的ConstMsg
+    template <class Msg>
+    void ws_resp(wsserver_t::connection_ptr &conn, const Msg &resp)
+    {
+        static thread_local std::string body; // 每个线程复用同一块编码缓冲区，send会拷贝一份
+        json_encode(resp, body);
+        _outbound.send(conn, body);
+    }
+    void ws_resp(wsserver_t::connection_ptr &conn, const std::string &body) { _outbound.send(conn, body); }
     session_ptr get_session_by_cookie(wsserver_t::connection_ptr &conn)
     {
         // 通过cookie获取到session_ptr(登录验证)
-        Json::Value err_resp;
         std::string cookie_str = conn->get_request_header("Cookie");
         if (cookie_str.empty())
         {
             // 如果没有cookie，返回错误“没有cookie信息，请重新登录”
-            err_resp["optype"] = "hall_ready";
-            err_resp["result"] = false;
-            err_resp["reason"] = "找不到cookie信息，请重新登录";
-            ws_resp(conn, err_resp);
+            ws_resp(conn, ConstMsg::no_cookie());
             return session_ptr();
         }
         // 从cookie中获取ssid
@@ -252,21 +594,15 @@ private:
         if (ret == false)
         {
             // cookie中没有ssid，返回错误“没有ssid信息，请重新登录”
-            err_resp["optype"] = "hall_ready";
-            err_resp["result"] = false;
-            err_resp["reason"] = "找不到ssid信息，请重新登录";
-            ws_resp(conn, err_resp);
+            ws_resp(conn, ConstMsg::no_ssid());
             return session_ptr();
         }
         // 在session管理中查找对应的会话信息
-        session_ptr ssp = _sm.getSessionBySsid(std::stol(ssid_str));
+        session_ptr ssp = find_session(ssid_str);
         if (ssp.get() == nullptr)
         {
             // 没有session，就认为“会话信息已经过期，请重新登录”
-            err_resp["optype"] = "hall_ready";
-            err_resp["result"] = false;
-            err_resp["reason"] = "登录过期，请重新登录";
-            ws_resp(conn, err_resp);
+            ws_resp(conn, ConstMsg::session_expired());
             return session_ptr();
         }
         return ssp;
@@ -275,77 +611,75 @@ private:
     {
         // 游戏大厅的websocket长连接建立成功
         // 1. 登录验证
-        Json::Value err_resp;
         session_ptr ssp = get_session_by_cookie(conn);
         if(ssp.get() == nullptr)
             return; // 登录验证失败
-        // 2. 判断当前客户端是否重新登录
-        if (_om.in_game_hall(ssp->get_user()) || _om.in_game_room(ssp->get_user()))
+        // 2. 不在线时将当前客户端以及链接加入到游戏大厅（检查和加入是一次操作），已经在大厅或房间中就是重复登录
+        if (_om.enter_game_hall(ssp->get_user(), conn) == false)
         {
-            // 玩家重复登录
-            err_resp["optype"] = "hall_ready";
-            err_resp["result"] = false;
-            err_resp["reason"] = "玩家重复登录";
-            return ws_resp(conn, err_resp);
+            return ws_resp(conn, ConstMsg::hall_relogin());
         }
-        // 3. 将当前客户端以及链接加入到游戏大厅
-        _om.enter_game_hall(ssp->get_user(), conn);
+        // 3. 把登录验证的结果绑定到连接上，之后的消息和关闭处理直接使用，不再解析cookie
+        conn->set_context(std::make_shared<ConnContext>(ROUTE_HALL, ssp, room_ptr(), false));
         // 4. 给客户端响应
-        Json::Value resp_json;
-        resp_json["optype"] = "hall_ready";
-        resp_json["result"] = true;
-        ws_resp(conn, resp_json);
+        ws_resp(conn, ConstMsg::hall_ready());
         // 5. 设置session永久存在
-        _sm.setExpirationTime(ssp->ssid(), SESSION_FOREVER);
+        _sm.setExpirationTime(ssp, SESSION_FOREVER);
     }
     void wsopen_game_room(wsserver_t::connection_ptr &conn)
     {
-        Json::Value resp_json;
         // 1. 用户认证并获取当前用户的session
         session_ptr ssp = get_session_by_cookie(conn);
         if(ssp.get() == nullptr)
         {
             return; // 用户认证失败
         }
-        // 2. 当前用户是否已经在游戏房间或游戏大厅中
-        if (_om.in_game_hall(ssp->get_user()) || _om.in_game_room(ssp->get_user()))
+        // 2. 不在线时将当前用户添加到_om中游戏房间，已经在游戏房间或游戏大厅中就是重复登录
+        if (_om.enter_game_room(ssp->get_user(), conn) == false)
         {
-            // 玩家重复登录
-            resp_json["optype"] = "room_ready";
-            resp_json["result"] = false;
-            resp_json["reason"] = "玩家重复登录";
-            return ws_resp(conn, resp_json);
+            return ws_resp(conn, ConstMsg::room_relogin());
         }
         // 3. 判断当前用户是否已经创建好房间
         room_ptr rp = _rm.get_room_by_uid(ssp->get_user());
         if(rp.get() == nullptr)
         {
             // 没有找到玩家的房间信息
-            resp_json["optype"] = "room_ready";
-            resp_json["result"] = false;
-            resp_json["reason"] = "没有找到玩家的房间信息";
-            return ws_resp(conn, resp_json);
+            _om.exit_game_room(ssp->get_user());
+            return ws_resp(conn, ConstMsg::room_not_found());
+        }
+        // 4. 把连接交给房间用于广播
+        bool binary = conn->get_subprotocol() == BINARY_SUBPROTOCOL;
+        rp->post(std::bind(&Room::set_conn, rp, ssp->get_user(), conn, binary));
+        // 5. 把用户、session和房间绑定到连接上，下棋/聊天消息直接找到房间，不再查找session和房间
+        conn->set_context(std::make_shared<ConnContext>(ROUTE_ROOM, ssp, rp, binary));
+        // 6. 设置session永久存在
+        _sm.setExpirationTime(ssp, SESSION_FOREVER);
+        // 7. 组织响应信息
+        RoomReadyResp resp = {rp->get_black_user(), rp->id(), ssp->get_user(), rp->get_white_user()};
+        return ws_resp(conn, resp);
+    }
+    bool wsvalidate_callback(websocketpp::connection_hdl hdl) // websocket握手阶段的处理函数
+    {
+        // 房间连接的客户端请求了二进制子协议就同意使用，否则保持JSON
+        wsserver_t::connection_ptr conn = _wssvr.get_con_from_hdl(hdl);
+        const std::vector<std::string> &protocols = conn->get_requested_subprotocols();
+        for (auto &proto : protocols)
+        {
+            if (proto == BINARY_SUBPROTOCOL && conn->get_request().get_uri() == "/room")
+            {
+                conn->select_subprotocol(proto);
+                break;
+            }
         }
-        // 4. 将当前用户添加到_om中游戏房间
-        _om.enter_game_room(ssp->get_user(), conn);
-        // 5. 设置session永久存在
-        _sm.setExpirationTime(ssp->ssid(), SESSION_FOREVER);
-        // 6. 组织响应信息
-        resp_json["optype"] = "room_ready";
-        resp_json["result"] = true;
-        resp_json["room_id"] = Json::UInt64(rp->id());
-        resp_json["uid"] = Json::UInt64(ssp->get_user());
-        resp_json["white_id"] = Json::UInt64(rp->get_white_user());
-        resp_json["black_id"] = Json::UInt64(rp->get_black_user());
-
-        return ws_resp(conn, resp_json);
+        return true;
     }
     void wsopen_callback(websocketpp::connection_hdl hdl) // websocket长连接建立成功之后的处理函数
     {
         // 由于websocket的长连接是基于页面的，当页面切换/关闭之后，原来的长连接就会关闭，所以这里需要游戏大厅的和游戏房间的两个长连接
+        // 路由只在连接建立时解析一次，结果保存在连接的上下文中
         wsserver_t::connection_ptr conn = _wssvr.get_con_from_hdl(hdl);
-        websocketpp::http::parser::request req = conn->get_request();
-        std::string uri = req.get_uri();
+        _heartbeat.add(conn);
+        const std::string &uri = conn->get_request().get_uri();
         if (uri == "/room")
         {
             // 建立游戏房间的长连接
@@ -357,145 +691,150 @@ private:
             wsopen_game_hall(conn);
         }
     }
-    void wsclose_game_hall(wsserver_t::connection_ptr &conn)
+    void wsclose_game_hall(ConnContext &ctx)
     {
-        // 0. 登录验证
-        Json::Value err_resp;
-        session_ptr ssp = get_session_by_cookie(conn);
-        if(ssp.get() == nullptr)
-            return; // 登录验证失败
         // 1. 将玩家从大厅移除
-        _om.exit_game_hall(ssp->get_user());
+        _om.exit_game_hall(ctx.uid);
+        _mm.del(ctx.uid); // 匹配中断开的玩家不再留在匹配池中
         // 2. 将session的生命周期恢复,设置定时销毁
-        _sm.setExpirationTime(ssp->ssid(), SESSION_TIMEOUT);
+        _sm.setExpirationTime(ctx.ssp, SESSION_TIMEOUT);
     }
-    void wsclose_game_room(wsserver_t::connection_ptr &conn)
+    void wsclose_game_room(ConnContext &ctx)
     {
-        // std::cout << "收到房间退出消息";
-        // 登录验证，获取会话信息
-        Json::Value err_resp;
-        session_ptr ssp = get_session_by_cookie(conn);
-        if(ssp.get() == nullptr)
-            return; // 登录验证失败
-        // std::cout << "from 用户id:" << ssp->get_user() << std::endl;
         // 1. 将玩家从om中移除
-        _om.exit_game_room(ssp->get_user());
+        _om.exit_game_room(ctx.uid);
         // 2. 将session的生命周期设置为定时销毁
-        _sm.setExpirationTime(ssp->ssid(), SESSION_TIMEOUT);
+        _sm.setExpirationTime(ctx.ssp, SESSION_TIMEOUT);
         // 3. 将玩家从game room中移除
-        _rm.remove_room_user(ssp->get_user());
+        _rm.remove_room_user(ctx.uid);
     }
     void wsclose_callback(websocketpp::connection_hdl hdl) // websocket链接断开前的处理
     {
         wsserver_t::connection_ptr conn = _wssvr.get_con_from_hdl(hdl);
-        websocketpp::http::parser::request req = conn->get_request();
-        std::string uri = req.get_uri();
-        if (uri == "/room")
+        _heartbeat.remove(conn);
+        std::shared_ptr<ConnContext> ctx = conn->get_context();
+        if (ctx.get() == nullptr)
+            return; // 连接建立时没有通过登录验证，没有需要清理的状态
+        if (ctx->route == ROUTE_ROOM)
         {
             // 断开游戏房间的长连接
-            wsclose_game_room(conn);
+            wsclose_game_room(*ctx);
         }
-        else if (uri == "/hall")
+        else if (ctx->route == ROUTE_HALL)
         {
             // 断开游戏大厅的长连接
-            wsclose_game_hall(conn);
+            wsclose_game_hall(*ctx);
         }
+        conn->set_context(std::shared_ptr<ConnContext>()); // 断开连接和房间之间的相互引用
     }
-    void wsmsg_game_hall(wsserver_t::connection_ptr &conn, wsserver_t::message_ptr msg)
+    void wsmsg_game_hall(wsserver_t::connection_ptr &conn, ConnContext &ctx, wsserver_t::message_ptr msg)
     {
-        // 0. 登录验证
-        Json::Value req_json, resp_json;
-        session_ptr ssp = get_session_by_cookie(conn);
-        if(ssp.get() == nullptr)
-            return; // 登录验证失败
+        // 0. 大厅中只有开始/停止匹配的请求，每个请求都会访问数据库，在解析之前按用户限流
+        if (_limiter.allow_match(ctx.uid) == false)
+        {
+            return ws_resp(conn, ConstMsg::match_limited());
+        }
+        Json::Value req_json;
         // 获取请求信息
-        std::string req_body = msg->get_payload();
+        const std::string &req_body = msg->get_payload();
         bool ret = JsonUtil::unserialize(req_body, req_json);
         if(ret == false)
         {
-            resp_json["result"] = false;
-            resp_json["reason"] = "请求信息解析失败";
-            return ws_resp(conn, resp_json);
+            return ws_resp(conn, ConstMsg::hall_bad_request());
         }
         // 处理请求(开始对战匹配，停止对战匹配)
         if(!req_json["optype"].isNull() && req_json["optype"].asString() == "match_start")
         {
-            // 开始对战匹配
-            _mm.add(ssp->get_user());
-            resp_json["optype"] = "match_start";
-            resp_json["result"] = true;
-            return ws_resp(conn, resp_json);
+            // 开始对战匹配，已经在匹配中的不重复进入匹配队列
+            if (_om.transition(ctx.uid, PRESENCE_HALL, PRESENCE_MATCHING))
+                _mm.add(ctx.uid);
+            return ws_resp(conn, ConstMsg::match_start());
         }
         else if(!req_json["optype"].isNull() && req_json["optype"].asString() == "match_stop")
         {
             // 停止对战匹配
-            _mm.del(ssp->get_user());
-            resp_json["optype"] = "match_stop";
-            resp_json["result"] = true;
-            return ws_resp(conn, resp_json);
+            if (_om.transition(ctx.uid, PRESENCE_MATCHING, PRESENCE_HALL))
+                _mm.del(ctx.uid);
+            return ws_resp(conn, ConstMsg::match_stop());
         }
         else
         {
-            resp_json["optype"] = "unknow";
-            resp_json["reason"] = "未知响应类型";
-            resp_json["result"] = false;
-            return ws_resp(conn, resp_json);
+            return ws_resp(conn, ConstMsg::unknown_optype());
         }
     }
-    void wsmsg_game_room(wsserver_t::connection_ptr &conn, wsserver_t::message_ptr msg)
+    void wsmsg_game_room(wsserver_t::connection_ptr &conn, ConnContext &ctx, wsserver_t::message_ptr msg)
     {
-        // 1. 获取客户端session，识别客户端身份
-        Json::Value resp_json;
-        session_ptr ssp = get_session_by_cookie(conn);
-        if(ssp.get() == nullptr)
-            return; // 登录验证失败
-        // 2. 获取房间信息
-        room_ptr rp = _rm.get_room_by_uid(ssp->get_user());
-        if(rp.get() == nullptr)
+        // 0. 二进制的下棋请求：不经过JSON解析，直接投递到房间
+        if (msg->get_opcode() == websocketpp::frame::opcode::binary)
         {
-            // 没有找到玩家的房间信息
-            resp_json["optype"] = "unknow";
-            resp_json["result"] = false;
-            resp_json["reason"] = "没有找到玩家的房间信息";
-            return ws_resp(conn, resp_json);
+            int row = 0, col = 0;
+            if (BinaryProto::decode_move(msg->get_payload(), row, col) == false)
+            {
+                return ws_resp(conn, ConstMsg::room_bad_request());
+            }
+            ctx.rp->post(std::bind(&Room::handle_move, ctx.rp, ctx.uid, row, col));
+            return;
         }
-        // 3. 对消息进行反序列化处理
+        // 1. 对消息进行反序列化处理（用户身份和房间在连接建立时已经确定）
         Json::Value req_json;
-        std::string req_body = msg->get_payload();
+        const std::string &req_body = msg->get_payload();
         bool ret = JsonUtil::unserialize(req_body, req_json);
         if(ret == false)
         {
-            resp_json["optype"] = "unknow";
-            resp_json["result"] = false;
-            resp_json["reason"] = "请求解析失败";
-            return ws_resp(conn, resp_json);
+            return ws_resp(conn, ConstMsg::room_bad_request());
         }
-        // 4. 通过房间模块进行消息请求的处理
-        return rp->handle_request(req_json);
+        // 2. 聊天按用户限流，被限流的消息只告知发送者，不进入房间
+        if (req_json["optype"].asString() == "chat" && _limiter.allow_chat(ctx.uid) == false)
+        {
+            return ws_resp(conn, ConstMsg::chat_limited());
+        }
+        // 3. 请求的发起者以连接绑定的用户为准，不信任客户端填写的uid
+        req_json["uid"] = Json::UInt64(ctx.uid);
+        // 4. 投递到房间的strand上，由房间模块串行处理消息请求
+        ctx.rp->post(std::bind(&Room::handle_request, ctx.rp, req_json));
+    }
+    void wspong_callback(websocketpp::connection_hdl hdl, std::string) // 收到客户端的pong
+    {
+        websocketpp::lib::error_code ec;
+        wsserver_t::connection_ptr conn = _wssvr.get_con_from_hdl(hdl, ec);
+        if (!ec && conn.get() != nullptr)
+            _heartbeat.touch(conn);
     }
     void wsmsg_callback(websocketpp::connection_hdl hdl, wsserver_t::message_ptr msg)
     {
         wsserver_t::connection_ptr conn = _wssvr.get_con_from_hdl(hdl);
-        websocketpp::http::parser::request req = conn->get_request();
-        std::string uri = req.get_uri();
-        if (uri == "/room")
+        _heartbeat.touch(conn);
+        std::shared_ptr<ConnContext> ctx = conn->get_context();
+        if (ctx.get() == nullptr)
+        {
+            // 连接建立时登录验证失败
+            return ws_resp(conn, ConstMsg::unauthorized());
+        }
+        if (ctx->route == ROUTE_ROOM)
         {
             // 游戏房间的消息
-            wsmsg_game_room(conn, msg);
+            wsmsg_game_room(conn, *ctx, msg);
         }
-        else if (uri == "/hall")
+        else if (ctx->route == ROUTE_HALL)
         {
             // 游戏大厅的消息
-            wsmsg_game_hall(conn, msg);
+            wsmsg_game_hall(conn, *ctx, msg);
         }
     }
 
 private:
     std::string _web_root;
+    AssetCache _assets; // 静态资源缓存
+    HeartbeatManager _heartbeat; // 长连接心跳管理
+    RequestLimiter _limiter;     // 登录、注册、匹配、聊天的限流
+    websocketpp::lib::asio::io_service _ios; // 需要在_wssvr之前构造、之后析构
     wsserver_t _wssvr;
-    UserTable _ut;
+    OutboundLimiter _outbound; // 长连接的发送限流
+    std::unique_ptr<UserStore> _ut; // 用户数据存储
+    ResultQueue _results; // 对战结果的异步写入队列，在房间管理之后析构，析构时写完剩余的结果
     OnlineManager _om;
     RoomManager _rm;
-    SessionManager _sm;
+    SessionManager _sm;  // session表，持久化到SESSION_FILE，重启后恢复
+    TokenSigner _tokens; // 设置了密钥时使用签名令牌代替_sm
     MatchManager _mm;
 };
\ No newline at end of file
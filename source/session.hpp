@@ -1,11 +1,23 @@
 #pragma once
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <unordered_map>
+#include <vector>
 
 #include "util.hpp"
 
 #define SESSION_TIMEOUT 30000
 #define SESSION_FOREVER -1
+#define SESSION_SWEEP_INTERVAL 5000       // 定时清理过期session的间隔(ms)
+#define SESSION_SHARDS 64                 // session表的分片数
+#define SESSION_FILE "./sessions.dat"     // session持久化文件
+#define SESSION_FILE_SLOTS (1 << 18)      // 持久化文件中的记录数，也就是最多持久化的session数
 
 typedef enum
 {
@@ -13,116 +25,274 @@ typedef enum
     LOGIN
 } sstatus_t;
 
+// 持久化文件中的一条记录，ssid为0表示空闲
+struct SessionRecord
+{
+    uint64_t ssid;
+    uint64_t uid;
+    int64_t expire; // 过期时间(system_clock的ms)
+    int32_t status;
+    int32_t reserved;
+};
+
 class Session
 {
 public:
-    Session(uint64_t ssid) : _ssid(ssid) { DBG_LOG("SESSION %p 被创建", this); }
+    Session(uint64_t ssid) : _ssid(ssid), _expire(INT64_MAX), _rec(nullptr), _slot(-1) { DBG_LOG("SESSION %p 被创建", this); }
     ~Session() { DBG_LOG("SESSION %p 被释放", this); }
     uint64_t ssid() { return _ssid; }
     void set_user(uint64_t uid) { _uid = uid; }
     void set_status(sstatus_t status) { _status = status; }
-    void set_timer(const wsserver_t::timer_ptr &tp) { _tp = tp; }
     uint64_t get_user() { return _uid; }
     sstatus_t get_status() { return _status; }
-    wsserver_t::timer_ptr &get_timer() { return _tp; }
     bool is_login() { return _status == LOGIN; }
+    // 设置过期时间，INT64_MAX表示永久存在；持久化记录由SessionManager在分片锁内更新
+    void set_expire(int64_t expire) { _expire.store(expire, std::memory_order_relaxed); }
+    int64_t get_expire() { return _expire.load(std::memory_order_relaxed); }
+    bool expired(int64_t now) { return now >= _expire.load(std::memory_order_relaxed); }
+    // 绑定持久化文件中的记录(以下三个函数都在SessionManager的分片锁内调用)
+    void set_record(SessionRecord *rec, int64_t slot)
+    {
+        _rec = rec;
+        _slot = slot;
+    }
+    SessionRecord *record() { return _rec; }
+    int64_t slot() { return _slot; }
 
 private:
-    uint64_t _ssid;            // session的标识符
-    uint64_t _uid;             // session对用的用户id
-    sstatus_t _status;         // 用户状态
-    wsserver_t::timer_ptr _tp; // 定时器
+    uint64_t _ssid;                     // session的标识符
+    uint64_t _uid;                      // session对用的用户id
+    sstatus_t _status;                  // 用户状态
+    std::atomic<int64_t> _expire;       // 过期时间(system_clock的ms)
+    SessionRecord *_rec;                // 在持久化文件中的记录，没有持久化时为nullptr(由分片锁保护)
+    int64_t _slot;                      // 记录的下标
 };
 
 using session_ptr = std::shared_ptr<Session>;
 
+/**
+ * session管理：过期采用惰性删除+定时清理，不再给每个session创建定时器
+ *   - 刷新session只是写一次过期时间(原子变量)，没有定时器的创建和取消，也没有取消定时器触发删除再重新添加的竞争
+ *   - 查找时发现已经过期就当作不存在并删除
+ *   - 服务器每SESSION_SWEEP_INTERVAL调用一次sweep，删除没有再被访问的过期session
+ * 每个http请求和长连接消息都要按ssid查找session，多线程下一把全局锁会成为竞争最激烈的地方：
+ *   - session按ssid分成SESSION_SHARDS个分片，每个分片一把锁，连续分配的ssid均匀落在不同分片上
+ *   - ssid用原子变量分配，创建session不需要全局锁
+ * 持久化：传入文件路径时，session同时保存在mmap的定长记录文件中，重启时不需要所有玩家重新登录
+ *   - 每个session占一条记录，创建时写入，刷新过期时间时(分片锁内)原地修改，删除时清空；都只是内存写，由内核写回文件
+ *   - 下标 % SESSION_SHARDS 相同的记录属于同一个分片，空闲记录在分片锁内分配和回收，不需要额外的锁
+ *   - 启动时扫描文件重建内存中的表，不访问数据库；重启时长连接都断开了，永久存在的session恢复为定时销毁
+ */
 class SessionManager
 {
 public:
-    SessionManager(wsserver_t *server) : _next_ssid(1), _server(server) { DBG_LOG("session 管理器初始化完毕"); }
-    ~SessionManager() { DBG_LOG("session 管理器销毁完毕"); }
+    SessionManager(const std::string &path = std::string()) : _next_ssid(1), _fd(-1), _records(nullptr)
+    {
+        if (!path.empty())
+            load(path);
+        DBG_LOG("session 管理器初始化完毕");
+    }
+    ~SessionManager()
+    {
+        if (_records != nullptr)
+            munmap(_records, sizeof(SessionRecord) * SESSION_FILE_SLOTS);
+        if (_fd >= 0)
+            close(_fd);
+        DBG_LOG("session 管理器销毁完毕");
+    }
     // 在本项目中用户只需要进行操作就一定要登录，所以没有不登陆的session状态，但是有些网站是允许一些操作是未登录的session
     session_ptr createSession(uint64_t uid, sstatus_t status)
     {
-        std::lock_guard<std::mutex> lck(_mutex);
-        session_ptr sp(new Session(_next_ssid));
+        uint64_t ssid = _next_ssid.fetch_add(1, std::memory_order_relaxed);
+        session_ptr sp(new Session(ssid));
         sp->set_user(uid);
         sp->set_status(status);
-        _sessions.insert(make_pair(_next_ssid, sp));
-        ++_next_ssid;
+        Shard &shard = shard_of(ssid);
+        std::lock_guard<std::mutex> lck(shard.mutex);
+        persist(shard, sp);
+        shard.sessions.insert(std::make_pair(ssid, sp));
         return sp;
     }
     session_ptr getSessionBySsid(uint64_t ssid)
     {
-        std::lock_guard<std::mutex> lck(_mutex);
-        auto it = _sessions.find(ssid);
-        if(it == _sessions.end())
+        Shard &shard = shard_of(ssid);
+        std::lock_guard<std::mutex> lck(shard.mutex);
+        auto it = shard.sessions.find(ssid);
+        if(it == shard.sessions.end())
         {
             return session_ptr();
         }
+        if (it->second->expired(now_ms()))
+        {
+            erase(shard, it); // 已经过期，还没有被定时清理
+            return session_ptr();
+        }
         return it->second;
     }
     void removeSession(uint64_t ssid)
     {
-        std::lock_guard<std::mutex> lck(_mutex);
-        _sessions.erase(ssid);
-    }
-    void appendSession(session_ptr ssp)
-    {
-        std::lock_guard<std::mutex> lck(_mutex); // 这个操作需要加锁保证线程安全
-        _sessions.insert(std::make_pair(ssp->ssid(), ssp));
+        Shard &shard = shard_of(ssid);
+        std::lock_guard<std::mutex> lck(shard.mutex);
+        auto it = shard.sessions.find(ssid);
+        if (it != shard.sessions.end())
+            erase(shard, it);
     }
     void setExpirationTime(uint64_t ssid, int ms)
     {
-        // 依赖于websocketpp的定时器来完成session生命周期的管理（设定指定时间之后执行删除session）
-        // 前提：session在创建的时候是“永久存在的”因为没有设置销毁时间
         session_ptr ssp = getSessionBySsid(ssid);
         if(ssp.get() == nullptr) return; //没有对应ssid的session,就直接return，不用设置
+        setExpirationTime(ssp, ms);
+    }
+    // 已经拿到session时直接刷新，不用再查找
+    // http短连接期间设置为ms之后过期，每次请求刷新；进入游戏大厅/游戏房间后使用长连接，设置为永久存在(SESSION_FOREVER)
+    // 持久化时在分片锁内原地更新记录：记录可能同时被删除回收并分配给别的session，不加锁会改掉别人的过期时间
+    void setExpirationTime(const session_ptr &ssp, int ms)
+    {
+        int64_t expire = ms == SESSION_FOREVER ? INT64_MAX : now_ms() + ms;
+        ssp->set_expire(expire);
+        if (_records == nullptr)
+            return;
+        Shard &shard = shard_of(ssp->ssid());
+        std::lock_guard<std::mutex> lck(shard.mutex);
+        SessionRecord *rec = ssp->record();
+        if (rec != nullptr)
+            rec->expire = expire;
+    }
+    // 删除所有已经过期的session，返回删除的个数（逐个分片加锁，不会长时间阻塞查找）
+    size_t sweep()
+    {
+        int64_t now = now_ms();
+        size_t count = 0;
+        for (auto &shard : _shards)
+        {
+            std::lock_guard<std::mutex> lck(shard.mutex);
+            for (auto it = shard.sessions.begin(); it != shard.sessions.end();)
+            {
+                if (it->second->expired(now))
+                {
+                    it = erase(shard, it);
+                    ++count;
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+        return count;
+    }
+    // 当前的session数
+    size_t size()
+    {
+        size_t count = 0;
+        for (auto &shard : _shards)
+        {
+            std::lock_guard<std::mutex> lck(shard.mutex);
+            count += shard.sessions.size();
+        }
+        return count;
+    }
 
-        wsserver_t::timer_ptr tp = ssp->get_timer();
-        // 1. 在用户登录期间使用的是http短连接，此时就需要给session设置销毁（指定时间无通信）的定时任务（永久存在->设置定时销毁）
-        if (tp.get() == nullptr && ms != SESSION_FOREVER)
+private:
+    typedef std::unordered_map<uint64_t, session_ptr> SessionMap;
+    struct Shard
+    {
+        std::mutex mutex;
+        SessionMap sessions;
+        std::vector<int64_t> free_slots; // 本分片空闲的记录下标
+    };
+    Shard &shard_of(uint64_t ssid) { return _shards[ssid % SESSION_SHARDS]; }
+    // 分配一条记录并写入session（调用时持有分片锁），文件满了就只保存在内存中
+    void persist(Shard &shard, const session_ptr &sp)
+    {
+        if (_records == nullptr)
+            return;
+        if (shard.free_slots.empty())
         {
-            wsserver_t::timer_ptr tp =  _server->set_timer(ms, 
-                std::bind(&SessionManager::removeSession, this, ssid));
-            ssp->set_timer(tp);
+            DBG_LOG("session持久化文件已满，session %lu 只保存在内存中", sp->ssid());
+            return;
         }
-        // 2. 在用户进入游戏大厅/游戏房间后，使用的应该是websocket长连接，此时session就需要永久存在（永久存在->永久存在）
-        else if(tp.get() == nullptr && ms == SESSION_FOREVER)
+        int64_t slot = shard.free_slots.back();
+        shard.free_slots.pop_back();
+        SessionRecord *rec = &_records[slot];
+        rec->uid = sp->get_user();
+        rec->expire = sp->get_expire();
+        rec->status = sp->get_status();
+        rec->ssid = sp->ssid(); // 最后写ssid，记录才算有效
+        sp->set_record(rec, slot);
+    }
+    // 从表中删除并回收记录（调用时持有分片锁）
+    SessionMap::iterator erase(Shard &shard, SessionMap::iterator it)
+    {
+        Session &s = *it->second;
+        SessionRecord *rec = s.record();
+        if (rec != nullptr)
         {
-            return; // tp中没有定时器，也不用重新设置定时器
+            int64_t slot = s.slot();
+            s.set_record(nullptr, -1); // 之后刷新过期时间不会再写到回收的记录
+            rec->ssid = 0;
+            shard.free_slots.push_back(slot);
         }
-        // 3. 在用户使用的协议从http切换到websocket的时候，需要将session设置为永久存在（设置定时销毁->永久存在）
-        else if(tp.get() != nullptr && ms == SESSION_FOREVER)
+        return shard.sessions.erase(it);
+    }
+    // 映射持久化文件并恢复其中没有过期的session
+    void load(const std::string &path)
+    {
+        auto start = std::chrono::steady_clock::now();
+        size_t bytes = sizeof(SessionRecord) * SESSION_FILE_SLOTS;
+        _fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (_fd < 0 || ftruncate(_fd, bytes) != 0) // 新文件是稀疏的，全0就是全部空闲
         {
-            // 删除之前的定时任务
-            tp->cancel(); // 但是这里调用cancel之后，当OS意识到有这个操作的时候，将会触发已经设定过的定时任务执行一次
-            // 因此我们在cancel之后需要在session管理器中重新添加这个session
-
-            // 由于上面调用cancel的时候并不是调用立即执行，而是等待OS意识到这个操作的时候才会执行（异步的）
-            // 所以我们不能在下面的代码中立即执行重新添加，否则就会出现“先添加了一次session，然后再执行的cancel”的情况
-            // 所以这里我们使用定时任务的方式让OS重新添加（这个定时为0即可），此时由于两个操作都是异步的，OS肯定是先是一道cancel然后再意识到重新添加操作
-            // 所以就不会出现这个问题，
-            ssp->set_timer(wsserver_t::timer_ptr()); // 设置永久存在的时候就是要让其tp为nullptr
-            _server->set_timer(0, std::bind(&SessionManager::appendSession, this, ssp));
+            ERR_LOG("打开session持久化文件 %s 失败，session只保存在内存中", path.c_str());
+            return;
         }
-        // 4. 用户在使用http短连接的时候，在指定时间内产生了通信，要刷新session设置的定时时间（设置定时销毁->重置定时销毁时间）
-        else if(tp.get() != nullptr && ms != SESSION_FOREVER)
+        void *addr = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        if (addr == MAP_FAILED)
         {
-            // 取消之前的定时任务
-            tp->cancel();
-            ssp->set_timer(wsserver_t::timer_ptr());
-            // 用定时器给session管理器中重新添加一个定时任务
-            _server->set_timer(0, std::bind(&SessionManager::appendSession, this, ssp));
-            // 用定时器设置定时销毁时间
-            wsserver_t::timer_ptr tp = _server->set_timer(ms, std::bind(&SessionManager::removeSession, this, ssp->ssid()));
-            ssp->set_timer(tp); // 重新设置session的定时器
+            ERR_LOG("映射session持久化文件 %s 失败，session只保存在内存中", path.c_str());
+            return;
         }
+        _records = (SessionRecord *)addr;
+        int64_t now = now_ms();
+        uint64_t max_ssid = 0;
+        size_t restored = 0;
+        for (int64_t slot = SESSION_FILE_SLOTS - 1; slot >= 0; --slot) // 倒序放入空闲列表，先分配下标小的
+        {
+            SessionRecord *rec = &_records[slot];
+            if (rec->ssid == 0 || rec->expire <= now || rec->ssid % SESSION_SHARDS != (uint64_t)slot % SESSION_SHARDS)
+            {
+                if (rec->ssid != 0)
+                    rec->ssid = 0;
+                _shards[slot % SESSION_SHARDS].free_slots.push_back(slot);
+                continue;
+            }
+            session_ptr sp(new Session(rec->ssid));
+            sp->set_user(rec->uid);
+            sp->set_status((sstatus_t)rec->status);
+            sp->set_record(rec, slot);
+            // 重启前的长连接都已经断开，永久存在的session恢复为定时销毁
+            if (rec->expire == INT64_MAX)
+                rec->expire = now + SESSION_TIMEOUT;
+            sp->set_expire(rec->expire);
+            _shards[rec->ssid % SESSION_SHARDS].sessions.insert(std::make_pair(rec->ssid, sp));
+            max_ssid = std::max(max_ssid, rec->ssid);
+            ++restored;
+        }
+        _next_ssid = max_ssid + 1;
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        INF_LOG("从 %s 恢复了 %lu 个session，耗时 %.1f ms", path.c_str(), (unsigned long)restored, ms);
+    }
+    static int64_t now_ms()
+    {
+        // 过期时间会保存到文件中，重启之后还要有效，所以使用system_clock而不是steady_clock
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
     }
 
 private:
-    uint64_t _next_ssid; // 
-    std::mutex _mutex;
-    std::unordered_map<uint64_t, session_ptr> _sessions;
-    wsserver_t *_server;
+    std::atomic<uint64_t> _next_ssid; // 下一个分配的ssid
+    Shard _shards[SESSION_SHARDS];
+    int _fd;                          // 持久化文件
+    SessionRecord *_records;          // 映射的持久化文件，没有持久化时为nullptr
 };
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vector>
+
+#include "history.hpp"
+#include "rank.hpp"
+#include "util.hpp"
+
+#define DEFAULT_SOCRE 1000 // 默认的天梯分数值
+#define ADD_SOCRE 30       // 每次胜利增加的天梯分数值
+
+// 一局对战的结果，seq是结果在写入队列中的序号，game.winner为0表示没有对战记录
+struct GameResult
+{
+    uint64_t seq;
+    uint64_t winner;
+    uint64_t loser;
+    GameRecord game;
+};
+
+/**
+ * 用户和积分的存储接口，服务器的其他模块只通过它访问用户数据
+ *   - UserTable(db.hpp): mysql实现，正式部署使用
+ *   - MemoryUserStore(memstore.hpp): 进程内的哈希表实现，可以附带一个追加写的文件，压测和没有数据库的机器上使用
+ * 排行榜由存储维护：加载数据时填充，积分变化时增量更新
+ */
+class UserStore
+{
+public:
+    virtual ~UserStore() {}
+    // 注册时新增用户，用户名已经存在返回false
+    virtual bool insert(Json::Value &user) = 0;
+    // 登录时验证用户并把其他信息放进user中
+    virtual bool login(Json::Value &user) = 0;
+    // 使用username查询，如果查到将结果放进user中
+    virtual bool select_by_name(const std::string &username, Json::Value &user) = 0;
+    // 使用id查询，如果查到将结果放进user中
+    virtual bool select_by_id(uint64_t id, Json::Value &user) = 0;
+    // 给赢的人增加天梯分数、总场数和胜场数
+    virtual bool win(uint64_t id) = 0;
+    // 给输的人增加总场数
+    virtual bool lose(uint64_t id) = 0;
+    // 原子地写入一批对战结果和对战记录，并把检查点更新为这批结果的最大序号
+    virtual bool apply_results(const std::vector<GameResult> &results) = 0;
+    // 已经写入的最大结果序号
+    virtual bool result_checkpoint(uint64_t &seq) = 0;
+    // uid参与的对战记录，按id从新到旧，只返回id小于before的
+    virtual bool history(uint64_t uid, uint64_t before, int limit, std::vector<GameSummary> &list) = 0;
+    // 一局对战的完整记录
+    virtual bool replay(uint64_t id, GameRecord &game) = 0;
+    // 输出存储自己的运行统计（由服务器的统计定时任务调用）
+    virtual void log_stats() = 0;
+    // 按积分排名的排行榜
+    Leaderboard &leaderboard() { return _rank; }
+
+protected:
+    Leaderboard _rank;
+};
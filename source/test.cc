@@ -1,6 +1,10 @@
 #include <iostream>
+#include <list>
 #include <vector>
 #include <exception>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 
 #include "room.hpp"
 #include "session.hpp"
@@ -34,6 +38,77 @@ void JsonUtil_test()
     std::cout << root2["age"].asInt() << std::endl;
     std::cout << root2["sex"].asString() << std::endl;
 }
+// 字段表编码的输出要和jsoncpp逐字节一致，不一致时直接abort（需要jsoncpp >= 1.9，见message.hpp）
+void Message_test()
+{
+    std::cout << "jsoncpp " << JSONCPP_VERSION_STRING << std::endl;
+    auto check = [](const std::string &name, const std::string &got, const Json::Value &expect)
+    {
+        std::string body;
+        JsonUtil::serialize(expect, &body);
+        std::cout << (got == body ? "[ok]   " : "[FAIL] ") << name << std::endl;
+        if (got != body)
+        {
+            std::cout << "  got:    " << got << std::endl << "  expect: " << body << std::endl;
+            abort();
+        }
+    };
+    Json::Value put_chess;
+    put_chess["optype"] = "put_chess";
+    put_chess["result"] = true;
+    put_chess["reason"] = "游戏继续";
+    put_chess["room_id"] = Json::UInt64(222);
+    put_chess["uid"] = Json::UInt64(1);
+    put_chess["row"] = 3;
+    put_chess["col"] = 18;
+    put_chess["winner"] = Json::UInt64(0);
+    check("put_chess", json_encode(PutChessResp{18, "游戏继续", 222, 3, 1, 0}), put_chess);
+
+    Json::Value chat;
+    chat["optype"] = "chat";
+    chat["result"] = true;
+    chat["room_id"] = Json::UInt64(18446744073709551615ULL);
+    chat["uid"] = Json::UInt64(7);
+    chat["message"] = "赶紧点\"\\\n\t\x01/😀 ok";
+    check("chat", json_encode(ChatResp{chat["message"].asString(), 18446744073709551615ULL, 7}), chat);
+    // 非法的UTF-8：单独的后续字节、超长编码、代理项、超出范围、0xF8以上的首字节、末尾不完整的序列
+    chat["message"] = std::string("\x85" "A \xBF \xC0\xAF \xE0\x80\xAF \xED\xA0\x80 \xF0\x80\x80\x80 "
+                                  "\xF4\x90\x80\x80 \xF8\x88 \xC3\xA9 \xE4\xB8");
+    check("chat invalid utf8", json_encode(ChatResp{chat["message"].asString(), 18446744073709551615ULL, 7}), chat);
+
+    Json::Value room_ready;
+    room_ready["optype"] = "room_ready";
+    room_ready["result"] = true;
+    room_ready["room_id"] = Json::UInt64(1);
+    room_ready["uid"] = Json::UInt64(2);
+    room_ready["white_id"] = Json::UInt64(2);
+    room_ready["black_id"] = Json::UInt64(3);
+    check("room_ready", json_encode(RoomReadyResp{3, 1, 2, 2}), room_ready);
+
+    Json::Value match_success;
+    match_success["room_id"] = Json::UInt64(42);
+    match_success["optype"] = "match_success";
+    match_success["result"] = true;
+    check("match_success", json_encode(MatchSuccessResp{42}), match_success);
+
+    Json::Value hall_ready;
+    hall_ready["optype"] = "hall_ready";
+    hall_ready["result"] = true;
+    check("hall_ready", ConstMsg::hall_ready(), hall_ready);
+
+    Json::Value fail;
+    fail["optype"] = "put_chess";
+    fail["result"] = false;
+    fail["reason"] = "走棋不合法，当前位置有棋啦!";
+    check("put_chess fail", json_encode(FailResp{"put_chess", "走棋不合法，当前位置有棋啦!"}), fail);
+    fail["room_id"] = Json::UInt64(5);
+    check("room fail", json_encode(RoomFailResp{"put_chess", "走棋不合法，当前位置有棋啦!", 5}), fail);
+
+    Json::Value result;
+    result["result"] = false;
+    result["reason"] = "请求过于频繁，请稍后再试";
+    check("http_limited", ConstMsg::http_limited(), result);
+}
 void StringUtil_test()
 {
     std::string str = "123,张三,,...,,234,345,456";
@@ -120,6 +195,60 @@ void db_test()
             DBG_LOG("lose success");
     }
 }
+void Leaderboard_test()
+{
+    // 和排序后的结果对比名次和分页
+    RankIndex idx;
+    std::map<uint64_t, int> socres;
+    for (int i = 0; i < 10000; ++i)
+    {
+        uint64_t uid = rand() % 500;
+        int socre = rand() % 50;
+        idx.set(uid, "user" + std::to_string(uid), socre);
+        socres[uid] = socre;
+    }
+    std::vector<std::pair<int, uint64_t>> sorted;
+    for (auto &it : socres)
+        sorted.push_back(std::make_pair(-it.second, it.first));
+    std::sort(sorted.begin(), sorted.end());
+    bool ok = idx.size() == sorted.size();
+    for (size_t i = 0; i < sorted.size(); ++i)
+    {
+        uint64_t rank = 0;
+        ok = ok && idx.rank(sorted[i].second, rank) && rank == i;
+    }
+    std::vector<RankEntry> page;
+    idx.range(100, 20, page);
+    for (size_t i = 0; i < page.size(); ++i)
+        ok = ok && page[i].uid == sorted[100 + i].second && page[i].rank == 101 + i;
+    std::cout << (ok ? "[ok]   " : "[FAIL] ") << "rank index" << std::endl;
+
+    Leaderboard lb;
+    lb.set(1, "张三", 1000);
+    lb.set(2, "李四", 1030);
+    lb.add(1, 60);
+    std::string body;
+    lb.page(0, 10, body);
+    std::cout << body << std::endl;
+    std::cout << "rank of 2: " << lb.rank(2) << std::endl;
+}
+void MoveCodec_test()
+{
+    // 下满棋盘再解码回来
+    std::string data;
+    std::vector<GameMove> moves;
+    for (int i = 0; i < BOARD_ROW * BOARD_COL; ++i)
+    {
+        GameMove m = {i % BOARD_COL, i % 2 + 1, i / BOARD_COL};
+        moves.push_back(m);
+        MoveCodec::append(data, i, m.row, m.col, m.color);
+    }
+    std::vector<GameMove> decoded;
+    bool ok = data.size() == GAME_MOVES_MAX && MoveCodec::decode(data, moves.size(), decoded);
+    for (size_t i = 0; ok && i < moves.size(); ++i)
+        ok = decoded[i].row == moves[i].row && decoded[i].col == moves[i].col && decoded[i].color == moves[i].color;
+    std::cout << (ok ? "[ok]   " : "[FAIL] ") << "move codec, " << data.size() << " bytes" << std::endl;
+}
 void OnlineManager_test()
 {
     OnlineManager om;
@@ -154,27 +283,262 @@ void OnlineManager_test()
         DBG_LOG("get uid:%d connection_ptr success, %p", uid2, ret2);
     else
         DBG_LOG("uid:%d connection_ptr is not exists", uid2);
+
+    // 状态转换：已经在线时不能再进入，只有在大厅中才能开始匹配
+    std::cout << "enter twice: " << om.enter_game_hall(1, conn) << om.enter_game_room(1, conn) << std::endl;
+    std::cout << "match: " << om.transition(1, PRESENCE_HALL, PRESENCE_MATCHING)
+              << om.transition(1, PRESENCE_HALL, PRESENCE_MATCHING) << om.in_game_hall(1) << std::endl;
+    om.exit_game_hall(1);
+    std::cout << "after exit: " << om.state(1) << om.enter_game_room(1, conn) << om.in_game_room(1) << std::endl;
 }
 
 void Room_test()
 {
     UserTable ut("127.0.0.1", "root", "zht1125x", "Rokuko");
-    OnlineManager om;
-    Room room1(10, &ut, &om);
+    ResultQueue results(&ut);
+    OutboundLimiter outbound;
+    websocketpp::lib::asio::io_service ios;
+    Room room1(10, &results, &outbound, ios);
 }
 
 void RomeManager_test()
 {
     UserTable ut("127.0.0.1", "root", "zht1125x", "Rokuko");
+    ResultQueue results(&ut);
     OnlineManager om;
-    RoomManager rm(&ut, &om);
+    OutboundLimiter outbound;
+    websocketpp::lib::asio::io_service ios;
+    RoomManager rm(&results, &om, &outbound, &ios);
     room_ptr rp = rm.createRoom(10, 20);
 }
 
 void SessionManager_test()
 {
-    wsserver_t wss;
-    SessionManager sm(&wss);
+    SessionManager sm;
+    session_ptr ssp = sm.createSession(1, LOGIN);
+    sm.setExpirationTime(ssp, 10);
+    std::cout << "before: " << (sm.getSessionBySsid(ssp->ssid()) != nullptr) << std::endl;
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::cout << "after: " << (sm.getSessionBySsid(ssp->ssid()) != nullptr) << std::endl;
+    sm.setExpirationTime(sm.createSession(2, LOGIN), SESSION_FOREVER);
+    std::cout << "swept: " << sm.sweep() << std::endl;
+    // 持久化：重新打开文件后session还在
+    uint64_t ssid = 0;
+    {
+        SessionManager persisted("./sessions_test.dat");
+        ssid = persisted.createSession(3, LOGIN)->ssid();
+        persisted.setExpirationTime(ssid, SESSION_TIMEOUT);
+    }
+    SessionManager restored("./sessions_test.dat");
+    session_ptr rsp = restored.getSessionBySsid(ssid);
+    std::cout << "restored: " << (rsp != nullptr && rsp->get_user() == 3) << std::endl;
+}
+
+// 多线程按ssid查找session的吞吐
+void SessionManager_bench()
+{
+    SessionManager sm;
+    std::vector<uint64_t> ssids;
+    for (int i = 0; i < 10000; ++i)
+        ssids.push_back(sm.createSession(i, LOGIN)->ssid());
+    for (int threads = 1; threads <= 8; threads *= 2)
+    {
+        std::atomic<uint64_t> found(0);
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> ths;
+        for (int t = 0; t < threads; ++t)
+        {
+            ths.push_back(std::thread([&, t]() {
+                uint64_t n = 0;
+                for (int i = 0; i < 1000000; ++i)
+                    n += sm.getSessionBySsid(ssids[(i * 7 + t) % ssids.size()]) != nullptr;
+                found += n;
+            }));
+        }
+        for (auto &th : ths)
+            th.join();
+        double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout << threads << " threads: " << (uint64_t)(found / sec) << " lookups/s" << std::endl;
+    }
+}
+
+void TokenSigner_test()
+{
+    TokenSigner signer;
+    signer.rotate(1, "first secret");
+    std::string token = signer.issue(42);
+    uint64_t uid = 0;
+    int64_t expire = 0;
+    std::cout << token << " -> " << signer.verify(token, uid, expire) << " uid=" << uid << std::endl;
+    std::string forged = token;
+    forged[3] = forged[3] == 'A' ? 'B' : 'A';
+    std::cout << "forged: " << signer.verify(forged, uid, expire) << std::endl;
+    std::cout << "expired: " << signer.verify(signer.issue(42, -1), uid, expire) << std::endl;
+    signer.rotate(2, "second secret"); // 轮换之后旧令牌仍然有效
+    std::cout << "after rotate: " << signer.verify(token, uid, expire) << std::endl;
+    signer.revoke(token);
+    std::cout << "revoked: " << signer.verify(token, uid, expire) << std::endl;
+    auto start = std::chrono::steady_clock::now();
+    std::string fresh = signer.issue(7);
+    int ok = 0;
+    for (int i = 0; i < 100000; ++i)
+        ok += signer.verify(fresh, uid, expire);
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    std::cout << ok << " verifies, " << us / 100000 << " us each" << std::endl;
+}
+
+void MatchQueue_bench()
+{
+    { // 去重和取消
+        MatchQueue<uint64_t> q;
+        bool ok = q.push(1) && q.push(2) && q.push(3) && q.push(1) == false && q.size() == 3;
+        ok = ok && q.remove(2) && q.remove(2) == false;
+        uint64_t a = 0, b = 0, c = 0;
+        ok = ok && q.pop(a) && q.pop(b) && q.pop(c) == false && a == 1 && b == 3 && q.push(1);
+        std::cout << (ok ? "[ok]   " : "[FAIL] ") << "dedup and cancel" << std::endl;
+    }
+    { // 排队的人很多时加入和取消的耗时
+        MatchQueue<uint64_t> q;
+        const int n = 100000;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < n; ++i)
+            q.push(i);
+        for (int i = 0; i < n; ++i)
+            q.remove((uint64_t)i * 7919 % n); // 乱序取消
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        std::cout << n << " pushes + " << n << " cancels: " << us / (2 * n) << " us each, left " << q.size() << std::endl;
+    }
+    { // 多个线程同时加入、重复加入和取消，一个消费者不断取出(和匹配模块的定时批量取出一样)，加入成功的次数等于取消和取出的次数之和
+        MatchQueue<uint64_t> q;
+        const int threads = 4, ops = 200000, uids = 1000;
+        std::atomic<uint64_t> pushed(0), removed(0), popped(0);
+        std::atomic<bool> done(false);
+        auto start = std::chrono::steady_clock::now();
+        std::thread consumer([&]() {
+            while (done == false)
+            {
+                uint64_t uid;
+                while (q.pop(uid))
+                    ++popped;
+                std::this_thread::yield();
+            }
+        });
+        std::vector<std::thread> ths;
+        for (int t = 0; t < threads; ++t)
+        {
+            ths.push_back(std::thread([&, t]() {
+                for (int i = 0; i < ops; ++i)
+                {
+                    uint64_t uid = (i * 31 + t * 17) % uids;
+                    if (i % 3 == 2)
+                        removed += q.remove(uid);
+                    else
+                        pushed += q.push(uid);
+                }
+            }));
+        }
+        for (auto &th : ths)
+            th.join();
+        done = true;
+        consumer.join();
+        uint64_t uid;
+        while (q.pop(uid)) // 消费者看到done之后退出时可能还有没取出的
+            ++popped;
+        double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        bool ok = pushed == removed + popped && q.empty();
+        std::cout << (ok ? "[ok]   " : "[FAIL] ") << threads << " threads: " << (uint64_t)(threads * ops / sec)
+                  << " ops/s, pushed " << pushed << ", cancelled " << removed << ", popped " << popped << std::endl;
+    }
+}
+
+// 模拟玩家陆续开始匹配，对比固定三档先到先配和按分差窗口批量匹配的等待时间和分差
+void RatingPool_test()
+{
+    const int ticks = 3000, per_tick = 4; // 每MATCH_TICK_INTERVAL来4个人
+    std::vector<int> socres;
+    for (int i = 0; i < ticks * per_tick; ++i)
+    {
+        double u1 = (rand() + 1.0) / (RAND_MAX + 2.0), u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+        socres.push_back(1800 + (int)(500 * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2))); // 正态分布
+    }
+    auto report = [&](const char *name, std::vector<int64_t> &waits, std::vector<int> &diffs) {
+        std::sort(waits.begin(), waits.end());
+        std::sort(diffs.begin(), diffs.end());
+        double mean = 0;
+        for (int d : diffs)
+            mean += d;
+        std::cout << name << ": matched " << waits.size() << "/" << socres.size()
+                  << ", median wait " << waits[waits.size() / 2] << " ms, p99 wait " << waits[waits.size() * 99 / 100]
+                  << " ms, mean diff " << mean / diffs.size() << ", p99 diff " << diffs[diffs.size() * 99 / 100] << std::endl;
+    };
+    { // 原来的三档队列：<2000, 2000~3000, >=3000，每档两人就配对
+        std::list<int> bands[3]; // 保存玩家下标
+        std::vector<int64_t> waits;
+        std::vector<int> diffs;
+        for (int t = 0; t < ticks; ++t)
+        {
+            for (int k = 0; k < per_tick; ++k)
+            {
+                int i = t * per_tick + k, s = socres[i];
+                std::list<int> &q = bands[s < 2000 ? 0 : s < 3000 ? 1 : 2];
+                q.push_back(i);
+                if (q.size() < 2)
+                    continue;
+                int a = q.front();
+                q.pop_front();
+                int b = q.front();
+                q.pop_front();
+                waits.push_back((int64_t)(t - a / per_tick) * MATCH_TICK_INTERVAL);
+                waits.push_back(0);
+                diffs.push_back(abs(socres[a] - socres[b]));
+            }
+        }
+        report("three bands", waits, diffs);
+    }
+    { // 分差窗口：按照服务器的节奏每MATCH_TICK_INTERVAL批量匹配一次
+        RatingPool pool;
+        std::vector<int64_t> waits;
+        std::vector<int> diffs;
+        std::vector<std::pair<MatchEntry, MatchEntry>> pairs;
+        for (int t = 0; t < ticks; ++t)
+        {
+            int64_t now = (int64_t)t * MATCH_TICK_INTERVAL;
+            for (int k = 0; k < per_tick; ++k)
+            {
+                int i = t * per_tick + k;
+                MatchEntry e = {(uint64_t)i, socres[i], now};
+                pool.insert(e);
+            }
+            pairs.clear();
+            pool.match(now, pairs);
+            for (auto &p : pairs)
+            {
+                waits.push_back(now - p.first.since);
+                waits.push_back(now - p.second.since);
+                diffs.push_back(abs(p.first.socre - p.second.socre));
+            }
+        }
+        report("rating window", waits, diffs);
+    }
+    { // 大量玩家排队时加入、取消和一次批量匹配的耗时
+        RatingPool pool;
+        const int n = 50000;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < n; ++i)
+        {
+            MatchEntry e = {(uint64_t)i, rand() % 3000, 0};
+            pool.insert(e);
+        }
+        for (int i = 0; i < n; i += 2)
+            pool.remove(i);
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        start = std::chrono::steady_clock::now();
+        std::vector<std::pair<MatchEntry, MatchEntry>> pairs;
+        pool.match(0, pairs);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << n << " inserts + " << n / 2 << " cancels: " << us / (n * 1.5) << " us each, tick over "
+                  << n / 2 << " players: " << ms << " ms, " << pairs.size() << " pairs" << std::endl;
+    }
 }
 
 void MatchManager_test()
@@ -182,10 +546,13 @@ void MatchManager_test()
     // try
     // {
         UserTable ut("127.0.0.1", "root", "zht1125x", "Rokuko");
+        ResultQueue results(&ut);
         OnlineManager om;
-        RoomManager rm(&ut, &om);
+        OutboundLimiter outbound;
+        websocketpp::lib::asio::io_service ios;
+        RoomManager rm(&results, &om, &outbound, &ios);
         room_ptr rp = rm.createRoom(10, 20);
-        MatchManager mm(&ut,&om, &rm);
+        MatchManager mm(&ut,&om, &rm, &outbound, &ios);
     // }
     // catch (std::exception& e)
     // {
@@ -204,6 +571,13 @@ void Server_test()
     svr.start(8081);
 }
 
+// 不依赖数据库的服务器，压测时使用：用户数据在内存中，同时追加写到./users.db，重启后恢复
+void MemoryServer_test()
+{
+    Server svr(std::unique_ptr<UserStore>(new MemoryUserStore("./users.db")));
+    svr.start(8081);
+}
+
 int main()
 {
     Server_test();
@@ -0,0 +1,210 @@
+#pragma once
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "util.hpp"
+
+#define TOKEN_TTL 1800       // 令牌的有效期(s)
+#define TOKEN_RENEW (TOKEN_TTL / 2) // 令牌剩余的有效期少于该值时，请求的响应中重新签发(s)
+#define TOKEN_MAC_LEN 16     // 令牌中保留的HMAC-SHA256的字节数
+#define TOKEN_MAX_KEYS 4     // 同时有效的密钥数，轮换时超过就丢弃最旧的
+
+/**
+ * 无状态的签名令牌：SSID cookie中直接携带 uid + 过期时间 + 密钥编号，再用HMAC-SHA256签名
+ *   - 验证只是一次HMAC计算和常数时间的比较，不查找任何共享的表，也不为空闲的用户保存任何状态
+ *   - 只要密钥相同，多个服务器进程签发的令牌可以互相验证，进程重启也不会让用户重新登录
+ *   - 密钥轮换：新令牌用当前密钥签名，之前的密钥(最多TOKEN_MAX_KEYS个)仍然可以验证，旧令牌自然过期
+ *     密钥集合创建后不再修改，轮换时创建新的集合并原子地替换指针，验证只是一次原子读；
+ *     旧的集合不释放(可能还有线程在读)，轮换很少发生，每次只多占用几十个字节
+ *   - 注销：令牌的签名放进一个小的撤销表，直到令牌过期；撤销表为空时验证不加锁
+ *     撤销表只在本进程有效，多进程部署时注销后其他进程仍然接受这个令牌直到过期
+ * 令牌格式：base64url(uid 8字节 | 过期时间 8字节 | 密钥编号 1字节) "." base64url(HMAC前TOKEN_MAC_LEN字节)
+ */
+class TokenSigner
+{
+public:
+    TokenSigner() : _revoked_count(0)
+    {
+        _sets.push_back(std::unique_ptr<KeySet>(new KeySet()));
+        _keys.store(_sets.back().get(), std::memory_order_release);
+    }
+    // 添加密钥并设为签发新令牌使用的密钥（轮换），之前的密钥继续用于验证
+    void rotate(uint8_t kid, const std::string &secret)
+    {
+        std::lock_guard<std::mutex> lck(_key_mutex);
+        std::unique_ptr<KeySet> keys(new KeySet(*_keys.load(std::memory_order_acquire)));
+        for (auto it = keys->keys.begin(); it != keys->keys.end(); ++it)
+        {
+            if (it->kid == kid)
+            {
+                keys->keys.erase(it);
+                break;
+            }
+        }
+        Key key = {kid, secret};
+        keys->keys.insert(keys->keys.begin(), key); // 第一个是当前密钥
+        if (keys->keys.size() > TOKEN_MAX_KEYS)
+            keys->keys.pop_back();
+        _keys.store(keys.get(), std::memory_order_release);
+        _sets.push_back(std::move(keys));
+    }
+    bool ready() { return !_keys.load(std::memory_order_acquire)->keys.empty(); }
+    // 给uid签发一个ttl秒之后过期的令牌
+    std::string issue(uint64_t uid, int ttl = TOKEN_TTL)
+    {
+        const KeySet *keys = _keys.load(std::memory_order_acquire);
+        if (keys->keys.empty())
+            return std::string();
+        const Key &key = keys->keys.front();
+        unsigned char payload[PAYLOAD_LEN];
+        int64_t expire = time(nullptr) + ttl;
+        memcpy(payload, &uid, 8);
+        memcpy(payload + 8, &expire, 8);
+        payload[16] = key.kid;
+        unsigned char mac[EVP_MAX_MD_SIZE];
+        sign(key, payload, mac);
+        return base64url(payload, PAYLOAD_LEN) + "." + base64url(mac, TOKEN_MAC_LEN);
+    }
+    // 验证令牌，成功时返回uid和过期时间
+    bool verify(const std::string &token, uint64_t &uid, int64_t &expire)
+    {
+        size_t dot = token.find('.');
+        if (dot == std::string::npos)
+            return false;
+        unsigned char payload[PAYLOAD_LEN], mac[TOKEN_MAC_LEN], expect[EVP_MAX_MD_SIZE];
+        if (unbase64url(token.data(), dot, payload, PAYLOAD_LEN) == false ||
+            unbase64url(token.data() + dot + 1, token.size() - dot - 1, mac, TOKEN_MAC_LEN) == false)
+            return false;
+        const KeySet *keys = _keys.load(std::memory_order_acquire);
+        const Key *key = nullptr;
+        for (auto &k : keys->keys)
+        {
+            if (k.kid == payload[16])
+                key = &k;
+        }
+        if (key == nullptr)
+            return false; // 密钥已经被轮换掉
+        sign(*key, payload, expect);
+        if (CRYPTO_memcmp(mac, expect, TOKEN_MAC_LEN) != 0)
+            return false;
+        memcpy(&uid, payload, 8);
+        memcpy(&expire, payload + 8, 8);
+        if (expire <= time(nullptr))
+            return false;
+        if (_revoked_count.load(std::memory_order_acquire) != 0)
+        {
+            std::lock_guard<std::mutex> lck(_revoke_mutex);
+            if (_revoked.find(std::string((const char *)mac, TOKEN_MAC_LEN)) != _revoked.end())
+                return false;
+        }
+        return true;
+    }
+    // 注销：令牌在过期之前都不再有效
+    void revoke(const std::string &token)
+    {
+        uint64_t uid = 0;
+        int64_t expire = 0;
+        if (verify(token, uid, expire) == false)
+            return;
+        std::string mac;
+        size_t dot = token.find('.');
+        mac.resize(TOKEN_MAC_LEN);
+        unbase64url(token.data() + dot + 1, token.size() - dot - 1, (unsigned char *)&mac[0], TOKEN_MAC_LEN);
+        int64_t now = time(nullptr);
+        std::lock_guard<std::mutex> lck(_revoke_mutex);
+        for (auto it = _revoked.begin(); it != _revoked.end();) // 顺便清理已经过期的，撤销表只保存还没过期的令牌
+        {
+            if (it->second <= now)
+                it = _revoked.erase(it);
+            else
+                ++it;
+        }
+        _revoked[mac] = expire;
+        _revoked_count.store(_revoked.size(), std::memory_order_release);
+    }
+
+private:
+    enum
+    {
+        PAYLOAD_LEN = 17
+    };
+    struct Key
+    {
+        uint8_t kid;
+        std::string secret;
+    };
+    struct KeySet
+    {
+        std::vector<Key> keys; // 第一个是当前签发使用的密钥
+    };
+    static void sign(const Key &key, const unsigned char *payload, unsigned char *mac)
+    {
+        unsigned int len = 0;
+        HMAC(EVP_sha256(), key.secret.data(), key.secret.size(), payload, PAYLOAD_LEN, mac, &len);
+    }
+    // cookie中不能有'='和'+'等字符，使用不带填充的base64url
+    static std::string base64url(const unsigned char *data, size_t len)
+    {
+        static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+        std::string out;
+        uint32_t acc = 0;
+        int bits = 0;
+        for (size_t i = 0; i < len; ++i)
+        {
+            acc = acc << 8 | data[i];
+            bits += 8;
+            while (bits >= 6)
+            {
+                bits -= 6;
+                out.push_back(table[(acc >> bits) & 0x3f]);
+            }
+        }
+        if (bits > 0)
+            out.push_back(table[(acc << (6 - bits)) & 0x3f]);
+        return out;
+    }
+    // 解码到正好len个字节，长度或字符不对返回false
+    static bool unbase64url(const char *src, size_t n, unsigned char *out, size_t len)
+    {
+        if (n != (len * 8 + 5) / 6)
+            return false;
+        uint32_t acc = 0;
+        int bits = 0;
+        size_t pos = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            char c = src[i];
+            int v = c >= 'A' && c <= 'Z' ? c - 'A' : c >= 'a' && c <= 'z' ? c - 'a' + 26
+                  : c >= '0' && c <= '9' ? c - '0' + 52 : c == '-' ? 62 : c == '_' ? 63 : -1;
+            if (v < 0)
+                return false;
+            acc = acc << 6 | v;
+            bits += 6;
+            if (bits >= 8)
+            {
+                bits -= 8;
+                if (pos < len)
+                    out[pos++] = (acc >> bits) & 0xff;
+            }
+        }
+        return pos == len;
+    }
+
+private:
+    std::mutex _key_mutex;                       // 只在轮换密钥时使用
+    std::vector<std::unique_ptr<KeySet>> _sets;  // 创建过的所有密钥集合，析构时释放
+    std::atomic<const KeySet *> _keys;           // 当前的密钥集合，验证时原子地读取，不加锁
+    std::mutex _revoke_mutex;
+    std::unordered_map<std::string, int64_t> _revoked; // 注销的令牌签名 -> 令牌的过期时间
+    std::atomic<size_t> _revoked_count;
+};
@@ -2,17 +2,55 @@
 #include <cstdio>
 #include <ctime>
 
+#include <atomic>
 #include <fstream>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <sstream>
+#include <streambuf>
 
 #include <mysql/mysql.h>
 #include <jsoncpp/json/json.h>
 #include <websocketpp/server.hpp>
 #include <websocketpp/config/asio_no_tls.hpp>
 
-typedef websocketpp::server<websocketpp::config::asio> wsserver_t;
+struct ConnContext; // websocket长连接的上下文，定义在server.hpp中
+
+// 连接的发送状态，由OutboundLimiter(outbound.hpp)维护
+struct OutboundState
+{
+    OutboundState() : queued(0), pending_op(websocketpp::frame::opcode::text), has_pending(false), evicted(false) {}
+    std::mutex mutex;                             // 多个线程可能同时向一个连接推送消息
+    size_t queued;                                // 发送缓冲上一次为空以来发出的消息数
+    std::string pending;                          // 溢出时合并保留的最新一条非关键消息
+    websocketpp::frame::opcode::value pending_op; // pending消息的帧类型
+    bool has_pending;                             // pending是否有效
+    bool evicted;                                 // 是否已经因为积压被关闭
+};
+
+// websocketpp的每个连接对象都会继承connection_base，这里用它把连接建立时得到的上下文挂在连接上
+class ConnBase
+{
+public:
+    ConnBase() : _last_active(0) {}
+    void set_context(const std::shared_ptr<ConnContext> &ctx) { _ctx = ctx; }
+    std::shared_ptr<ConnContext> get_context() const { return _ctx; }
+    OutboundState &outbound() { return _outbound; }
+    std::atomic<int64_t> &last_active() { return _last_active; } // 最近活跃时间(ms)，由HeartbeatManager维护
+
+private:
+    std::shared_ptr<ConnContext> _ctx;
+    OutboundState _outbound;
+    std::atomic<int64_t> _last_active;
+};
+
+struct wsconfig_t : public websocketpp::config::asio
+{
+    typedef ConnBase connection_base;
+};
+
+typedef websocketpp::server<wsconfig_t> wsserver_t;
 
 /*************************这里是一个日志的宏，用于简单的打印日志*****************************/
 /**
@@ -51,6 +89,9 @@ typedef websocketpp::server<websocketpp::config::asio> wsserver_t;
 
 /*************************这里是一个mysql工具类，用于封装mysql的一些C接口*****************************/
 
+#define MYSQL_CONNECT_TIMEOUT 3 // 连接mysql的超时时间(s)
+#define MYSQL_RW_TIMEOUT 10     // 读写mysql的超时时间(s)
+
 class MysqlUtil
 {
 public:
@@ -65,16 +106,23 @@ public:
             ERR_LOG("构建mysql句柄出错: %s", mysql_error(mysql));
             return nullptr;
         }
-        // 2. 连接mysql服务器
+        // 2. 设置超时时间，服务器不可达时不会让事件循环线程一直阻塞
+        unsigned int connect_timeout = MYSQL_CONNECT_TIMEOUT, rw_timeout = MYSQL_RW_TIMEOUT;
+        mysql_options(mysql, MYSQL_OPT_CONNECT_TIMEOUT, &connect_timeout);
+        mysql_options(mysql, MYSQL_OPT_READ_TIMEOUT, &rw_timeout);
+        mysql_options(mysql, MYSQL_OPT_WRITE_TIMEOUT, &rw_timeout);
+        // 3. 连接mysql服务器
         if (mysql_real_connect(mysql, host.c_str(), user.c_str(), passwd.c_str(), db.c_str(), port, nullptr, 0) == nullptr)
         {
             ERR_LOG("连接mysql服务出错: %s", mysql_error(mysql));
+            mysql_close(mysql);
             return nullptr;
         }
-        // 3. 设置字符集
+        // 4. 设置字符集
         if (mysql_set_character_set(mysql, "utf8") != 0)
         {
             ERR_LOG("设置字符集出错: %s", mysql_error(mysql));
+            mysql_close(mysql);
             return nullptr;
         }
         return mysql;
@@ -102,37 +150,91 @@ public:
 
 /*************************这里是一个Json工具类，用于封装Json的序列化和反序列化*****************************/
 
+// 把输出直接追加到std::string中的streambuf，序列化时不再经过stringstream再拷贝一次
+class StringAppendBuf : public std::streambuf
+{
+public:
+    StringAppendBuf() : _str(nullptr) {}
+    void reset(std::string *str) { _str = str; }
+
+protected:
+    int_type overflow(int_type ch) override
+    {
+        if (ch != traits_type::eof())
+            _str->push_back((char)ch);
+        return ch;
+    }
+    std::streamsize xsputn(const char *s, std::streamsize n) override
+    {
+        _str->append(s, n);
+        return n;
+    }
+
+private:
+    std::string *_str;
+};
+
 class JsonUtil
 {
 public:
-    // 序列化
-    static bool serialize(const Json::Value &root, std::string *str)
+    // 序列化：默认输出不带缩进的紧凑格式，结果覆盖写入str（str已有的容量会被复用）
+    static bool serialize(const Json::Value &root, std::string *str, bool compact = true)
     {
-        std::stringstream ss;
-        std::unique_ptr<Json::StreamWriter> sw(Json::StreamWriterBuilder().newStreamWriter());
-        int ret = sw->write(root, &ss);
-        if (ret != 0)
+        str->clear();
+        Codec &c = codec();
+        c.buf.reset(str);
+        int ret = (compact ? c.compact : c.pretty)->write(root, &c.os);
+        c.buf.reset(nullptr);
+        if (ret != 0 || !c.os)
         {
+            c.os.clear();
             ERR_LOG("json serialize fail");
             return false;
         }
-        *str = ss.str();
         return true;
     }
+    // 反序列化
     static bool unserialize(const std::string &str, Json::Value &root)
     {
-        std::string err;
-        std::unique_ptr<Json::CharReader> cr(Json::CharReaderBuilder().newCharReader());
-        bool ret = cr->parse(str.c_str(), str.c_str() + str.size(), &root, &err);
+        return unserialize(str.c_str(), str.size(), root);
+    }
+    static bool unserialize(const char *data, size_t len, Json::Value &root)
+    {
+        Codec &c = codec();
+        c.err.clear();
+        bool ret = c.reader->parse(data, data + len, &root, &c.err);
         if (ret == false)
         {
-            ERR_LOG("json unserialize fail: %s", err.c_str());
+            ERR_LOG("json unserialize fail: %s", c.err.c_str());
             return false;
         }
         return true;
     }
 
-    // 反序列化
+private:
+    // 每个线程缓存一套writer/reader，避免每次调用都重新构建builder、分配writer/reader对象
+    struct Codec
+    {
+        Codec() : os(&buf)
+        {
+            Json::StreamWriterBuilder swb;
+            pretty.reset(swb.newStreamWriter());
+            swb["indentation"] = "";
+            compact.reset(swb.newStreamWriter());
+            reader.reset(Json::CharReaderBuilder().newCharReader());
+        }
+        std::unique_ptr<Json::StreamWriter> compact; // 紧凑格式的writer
+        std::unique_ptr<Json::StreamWriter> pretty;  // 带缩进格式的writer
+        std::unique_ptr<Json::CharReader> reader;
+        StringAppendBuf buf;
+        std::ostream os; // 输出到buf指向的字符串
+        std::string err;
+    };
+    static Codec &codec()
+    {
+        static thread_local Codec c;
+        return c;
+    }
 };
 
 // 字符串分割工具